@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "circular_buffer.h"
+
+/*
+ * Measures cb_write/cb_read throughput and per-call latency over a sweep of
+ * message sizes, capacities and thread topologies:
+ *
+ *   spsc  one producer, one consumer: mutex vs CB_SPSC
+ *   mpsc  several producers, one consumer: mutex vs CB_MPSC
+ *   mpmc  several producers and consumers: mutex vs struct cb_mpmc
+ *
+ * mpsc and mpmc are also swept from 1 to MAX_THREADS threads: mpsc runs that
+ * many producers, mpmc splits them into half producers, half consumers.
+ *
+ * Every message is written and read whole. Latencies are sampled so that
+ * each thread keeps at most MAX_SAMPLES of them, and only sampled messages
+ * read the clock. A sample runs from the first attempt to the successful
+ * call, so it includes any retries on a full or empty buffer.
+ */
+
+#define MAX_THREADS 32
+#define MAX_SAMPLES 100000
+
+static struct option _options[] = {
+	{ "ops", required_argument, 0, 'n' },
+	{ "size", required_argument, 0, 's' },
+	{ "capacity", required_argument, 0, 'c' },
+	{ "topology", required_argument, 0, 't' },
+	{ "threads", required_argument, 0, 'p' },
+	{ "format", required_argument, 0, 'f' },
+	{ 0, 0, 0, 0 },
+};
+
+static const size_t _sizes[] = {
+	1, 16, 64, 256, 1024, 4096, 16384, 65536,
+};
+
+static const size_t _capacities[] = {
+	64 * 1024, 1024 * 1024,
+};
+
+static const int _threads[] = {
+	1, 2, 4, 8, 16, 32,
+};
+
+struct run {
+	const char *topology;
+	const char *impl;
+	int producers;
+	int consumers;
+	size_t size;
+	size_t capacity;
+	long ops; /* messages in total */
+	long consumed;
+	struct circular_buffer *buffer;
+	struct cb_mpmc *ring;
+};
+
+struct worker {
+	struct run *run;
+	long ops;
+	long every; /* sample one call out of this many */
+	long *samples;
+	size_t nsamples;
+};
+
+struct result {
+	double seconds;
+	double write_ns[3];
+	double read_ns[3];
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Allocates `size` bytes or ends the run, like any other setup failure. */
+static void *alloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (!p) {
+		fprintf(stderr, "Could not allocate %zu bytes.\n", size);
+		exit(-1);
+	}
+	return p;
+}
+
+static int push(struct run *r, char *msg)
+{
+	if (r->ring)
+		return cb_mpmc_push(r->ring, msg);
+	return cb_write64(r->buffer, msg, r->size) < 0 ? -1 : 0;
+}
+
+static int pop(struct run *r, char *msg)
+{
+	if (r->ring)
+		return cb_mpmc_pop(r->ring, msg);
+	/* Messages are written whole, so a non-empty buffer holds at least one. */
+	return cb_read64(r->buffer, msg, r->size) > 0 ? 0 : -1;
+}
+
+/* Returns the start time if message `i` is sampled, zero otherwise. */
+static long long stamp(struct worker *w, long i)
+{
+	if (i % w->every == 0 && w->nsamples < MAX_SAMPLES)
+		return now_ns();
+	return 0;
+}
+
+static void sample(struct worker *w, long long start)
+{
+	if (start)
+		w->samples[w->nsamples++] = now_ns() - start;
+}
+
+static void* producer(void *arg)
+{
+	struct worker *w = arg;
+	char *msg = alloc(w->run->size);
+	long long start;
+	long i;
+
+	memset(msg, 0xa5, w->run->size);
+	for (i = 0; i < w->ops; i++) {
+		start = stamp(w, i);
+		while (push(w->run, msg) < 0)
+			sched_yield();
+		sample(w, start);
+	}
+	free(msg);
+	return 0;
+}
+
+static void* consumer(void *arg)
+{
+	struct worker *w = arg;
+	struct run *r = w->run;
+	char *msg = alloc(r->size);
+	long long start = 0;
+	long i = 0;
+
+	while (__atomic_load_n(&r->consumed, __ATOMIC_RELAXED) < r->ops) {
+		/* Stamp the first attempt at message `i` only. */
+		if (!start)
+			start = stamp(w, i);
+		if (pop(r, msg) < 0) {
+			sched_yield();
+			continue;
+		}
+		__atomic_fetch_add(&r->consumed, 1, __ATOMIC_RELAXED);
+		sample(w, start);
+		start = 0;
+		i++;
+	}
+	free(msg);
+	return 0;
+}
+
+static int compare(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Merges the samples of `workers` and stores their p50, p99 and p99.9. */
+static void percentiles(struct worker *workers, int count, double *out)
+{
+	static const double ranks[3] = { 0.5, 0.99, 0.999 };
+	size_t i, n = 0;
+	long *all;
+	int w;
+
+	for (w = 0; w < count; w++)
+		n += workers[w].nsamples;
+	if (n == 0) {
+		out[0] = out[1] = out[2] = 0;
+		return;
+	}
+
+	all = alloc(n * sizeof(long));
+	for (n = 0, w = 0; w < count; w++) {
+		memcpy(all + n, workers[w].samples, workers[w].nsamples * sizeof(long));
+		n += workers[w].nsamples;
+	}
+	qsort(all, n, sizeof(long), compare);
+	for (i = 0; i < 3; i++)
+		out[i] = all[(size_t)(ranks[i] * (n - 1))];
+	free(all);
+}
+
+static struct worker *workers(struct run *r, int count, long ops)
+{
+	struct worker *w = alloc(count * sizeof(struct worker));
+	int i;
+
+	memset(w, 0, count * sizeof(struct worker));
+	for (i = 0; i < count; i++) {
+		w[i].run = r;
+		w[i].ops = ops / count + (i < ops % count);
+		w[i].every = ops / count / MAX_SAMPLES + 1;
+		w[i].samples = alloc(MAX_SAMPLES * sizeof(long));
+	}
+	return w;
+}
+
+static void free_workers(struct worker *w, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		free(w[i].samples);
+	free(w);
+}
+
+static void run(struct run *r, struct result *result)
+{
+	struct worker *prod = workers(r, r->producers, r->ops);
+	struct worker *cons = workers(r, r->consumers, r->ops);
+	pthread_t tids[2 * MAX_THREADS];
+	long long start;
+	int t;
+
+	r->consumed = 0;
+	start = now_ns();
+	for (t = 0; t < r->consumers; t++)
+		pthread_create(&tids[t], NULL, consumer, &cons[t]);
+	for (t = 0; t < r->producers; t++)
+		pthread_create(&tids[r->consumers + t], NULL, producer, &prod[t]);
+	for (t = 0; t < r->consumers + r->producers; t++)
+		pthread_join(tids[t], NULL);
+	result->seconds = (now_ns() - start) / 1e9;
+
+	percentiles(prod, r->producers, result->write_ns);
+	percentiles(cons, r->consumers, result->read_ns);
+	free_workers(prod, r->producers);
+	free_workers(cons, r->consumers);
+}
+
+static void report(struct run *r, struct result *res, int json, int first)
+{
+	double ops = r->ops / res->seconds;
+	double gbps = ops * r->size / 1e9;
+
+	if (!json) {
+		printf("%s,%s,%d,%d,%zu,%zu,%ld,%.6f,%.0f,%.4f,"
+			"%.0f,%.0f,%.0f,%.0f,%.0f,%.0f\n",
+			r->topology, r->impl, r->producers, r->consumers, r->size,
+			r->capacity, r->ops, res->seconds, ops, gbps,
+			res->write_ns[0], res->write_ns[1], res->write_ns[2],
+			res->read_ns[0], res->read_ns[1], res->read_ns[2]);
+	} else {
+		printf("%s  {\"topology\": \"%s\", \"impl\": \"%s\", "
+			"\"producers\": %d, \"consumers\": %d, \"msg_size\": %zu, "
+			"\"capacity\": %zu, \"ops\": %ld, \"seconds\": %.6f, "
+			"\"ops_per_sec\": %.0f, \"gb_per_sec\": %.4f, "
+			"\"write_ns\": {\"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f}, "
+			"\"read_ns\": {\"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f}}",
+			first ? "" : ",\n", r->topology, r->impl, r->producers,
+			r->consumers, r->size, r->capacity, r->ops, res->seconds,
+			ops, gbps, res->write_ns[0], res->write_ns[1],
+			res->write_ns[2], res->read_ns[0], res->read_ns[1],
+			res->read_ns[2]);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Runs one topology at one size and capacity against both of its
+ * implementations. Returns the number of runs reported.
+ */
+static int bench(const char *topology, int threads, size_t size,
+		size_t capacity, long ops, int json, int first)
+{
+	struct run r;
+	struct result res;
+	int lockfree, reported = 0;
+
+	for (lockfree = 0; lockfree < 2; lockfree++) {
+		memset(&r, 0, sizeof(r));
+		r.topology = topology;
+		r.size = size;
+		r.capacity = capacity;
+		r.ops = ops;
+		r.producers = 1;
+		r.consumers = 1;
+		if (strcmp(topology, "mpsc") == 0) {
+			r.producers = threads;
+		} else if (strcmp(topology, "mpmc") == 0 && threads > 1) {
+			r.producers = threads / 2;
+			r.consumers = threads - threads / 2;
+		}
+
+		if (!lockfree) {
+			r.impl = "mutex";
+			r.buffer = cb_create64(capacity);
+		} else if (strcmp(topology, "spsc") == 0) {
+			r.impl = "spsc";
+			r.buffer = cb_create_flags(capacity, CB_SPSC);
+		} else if (strcmp(topology, "mpsc") == 0) {
+			r.impl = "mpsc";
+			r.buffer = cb_create_flags(capacity, CB_MPSC);
+		} else {
+			r.impl = "mpmc";
+			r.ring = cb_mpmc_create(capacity / size, size);
+		}
+		if (!r.buffer && !r.ring) {
+			fprintf(stderr, "Could not create the %s buffer.\n", r.impl);
+			exit(-1);
+		}
+
+		run(&r, &res);
+		report(&r, &res, json, first && reported == 0);
+		reported++;
+
+		if (r.buffer)
+			cb_destroy(r.buffer);
+		if (r.ring)
+			cb_mpmc_destroy(r.ring);
+	}
+
+	return reported;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n ops] [-s msg_size] [-c capacity] "
+		"[-t spsc|mpsc|mpmc] [-p threads] [-f csv|json]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *topologies[] = { "spsc", "mpsc", "mpmc" };
+	const char *topology = NULL;
+	size_t size = 0, capacity = 0, s, c;
+	long ops = 1000000, n;
+	int opt, t, p, threads = 0, json = 0, runs = 0;
+
+	while ((opt = getopt_long(argc, argv, "n:s:c:t:p:f:", _options, 0)) != -1) {
+		switch (opt) {
+		case 'n':
+			ops = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			capacity = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			topology = optarg;
+			break;
+		case 'p':
+			threads = strtol(optarg, NULL, 10);
+			break;
+		case 'f':
+			json = strcmp(optarg, "json") == 0;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if (ops < 1 || threads < 0 || threads > MAX_THREADS) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (json)
+		printf("[\n");
+	else
+		printf("topology,impl,producers,consumers,msg_size,capacity,ops,"
+			"seconds,ops_per_sec,gb_per_sec,write_p50_ns,write_p99_ns,"
+			"write_p999_ns,read_p50_ns,read_p99_ns,read_p999_ns\n");
+
+	for (t = 0; t < 3; t++) {
+		if (topology && strcmp(topology, topologies[t]) != 0)
+			continue;
+		for (p = 0; p < (int)(sizeof(_threads) / sizeof(_threads[0])); p++) {
+			/* spsc always runs one thread per side. */
+			if ((threads || t == 0) && p > 0)
+				break;
+			/* mpmc needs two threads to have one per side. */
+			if (!threads && t == 2 && _threads[p] < 2)
+				continue;
+			for (c = 0; c < sizeof(_capacities) / sizeof(_capacities[0]); c++) {
+				if (capacity && c > 0)
+					break;
+				for (s = 0; s < sizeof(_sizes) / sizeof(_sizes[0]); s++) {
+					if (size && s > 0)
+						break;
+					if ((size ? size : _sizes[s]) >
+							(capacity ? capacity : _capacities[c]) / 2)
+						continue;
+					/* Keep large messages from moving gigabytes per run. */
+					n = (256L << 20) / (size ? size : _sizes[s]);
+					runs += bench(topologies[t],
+						threads ? threads : _threads[p],
+						size ? size : _sizes[s],
+						capacity ? capacity : _capacities[c],
+						n < ops ? n : ops, json, runs == 0);
+				}
+			}
+		}
+	}
+
+	if (json)
+		printf("\n]\n");
+
+	return 0;
+}
@@ -0,0 +1,343 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "circular_buffer.h"
+#include "internal.h"
+
+/*
+ * Single-producer ring read by several consumers, each with its own cursor.
+ * The producer never overwrites bytes the slowest registered reader has not
+ * consumed yet, in the manner of the LMAX Disruptor's gating sequences.
+ * Readers look at the data in place, so it is stored once no matter how
+ * many consumers there are. Capacity is a power of two and all positions
+ * are free-running counters.
+ */
+
+enum {
+	READER_FREE,
+	READER_JOINING,
+	READER_ACTIVE,
+};
+
+struct cb_broadcast_reader {
+	CB_CACHELINE size_t tail;
+	size_t cached_head;
+	int state;
+	struct cb_broadcast *ring;
+};
+
+struct cb_broadcast {
+	char *buffer;
+	size_t length;
+	size_t mask;
+	int flags;
+	int max_readers;
+	struct cb_broadcast_reader *readers;
+	int joining; /* readers waiting to be admitted by the producer */
+
+	/* Producer side: head and the slowest tail it has seen. */
+	CB_CACHELINE size_t head;
+	size_t cached_tail;
+};
+
+/**
+ * Creates a broadcast ring holding at least `length` bytes for up to
+ * `max_readers` readers. `length` is rounded up to a power of two.
+ *
+ * `flags` may contain CB_MIRRORED so that readers always see their data as
+ * one contiguous span.
+ *
+ * @param length the number of bytes the ring can hold
+ * @param max_readers the number of readers that can be joined at once
+ * @param flags CB_* creation flags
+ *
+ * @return The new ring, or NULL on failure.
+ */
+CBAPI struct cb_broadcast * CBCALL cb_broadcast_create(size_t length,
+		int max_readers, int flags)
+{
+#ifdef HAVE_ATOMICS
+	struct cb_broadcast *ring;
+	int i;
+
+	if (length > (size_t)SSIZE_MAX / 2 || max_readers < 1 ||
+			(flags & ~CB_MIRRORED)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ring = _cb_alloc_aligned(sizeof(struct cb_broadcast));
+	if (!ring)
+		return NULL;
+	memset(ring, 0, sizeof(struct cb_broadcast));
+
+	ring->flags = flags;
+	ring->max_readers = max_readers;
+	ring->length = 1;
+	while (ring->length < length)
+		ring->length <<= 1;
+	if ((flags & CB_MIRRORED) && ring->length < _cb_page_size())
+		ring->length = _cb_page_size();
+	ring->mask = ring->length - 1;
+
+	ring->readers = _cb_alloc_aligned(max_readers
+		* sizeof(struct cb_broadcast_reader));
+	if (!ring->readers)
+		goto fail;
+	memset(ring->readers, 0, max_readers * sizeof(struct cb_broadcast_reader));
+	for (i = 0; i < max_readers; i++)
+		ring->readers[i].ring = ring;
+
+	if (flags & CB_MIRRORED)
+		ring->buffer = _cb_mirror_map(ring->length);
+	else
+		ring->buffer = calloc(ring->length, sizeof(char));
+	if (!ring->buffer)
+		goto fail_readers;
+
+	return ring;
+fail_readers:
+	_cb_free_aligned(ring->readers);
+fail:
+	_cb_free_aligned(ring);
+	return NULL;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+CBAPI void CBCALL cb_broadcast_destroy(struct cb_broadcast *ring)
+{
+	/* Make sure no other threads are using the ring before destroying it. */
+	if (ring->flags & CB_MIRRORED)
+		_cb_mirror_unmap(ring->buffer, ring->length);
+	else
+		free(ring->buffer);
+	_cb_free_aligned(ring->readers);
+	_cb_free_aligned(ring);
+}
+
+/**
+ * Registers a new reader.
+ *
+ * The producer admits the reader at the start of its next write, setting the
+ * cursor to its own head, so the reader sees everything from that write on.
+ * Until then the reader has no data. Safe to call while the producer and
+ * other readers are running.
+ *
+ * @param ring the ring to read from
+ *
+ * @return The reader's cursor, or NULL if `max_readers` are already joined.
+ */
+CBAPI struct cb_broadcast_reader * CBCALL cb_broadcast_join(struct cb_broadcast *ring)
+{
+	int i, state;
+
+	for (i = 0; i < ring->max_readers; i++) {
+		state = READER_FREE;
+		if (compare_exchange(&ring->readers[i].state, &state, READER_JOINING)) {
+			fetch_add(&ring->joining, 1);
+			return &ring->readers[i];
+		}
+	}
+
+	errno = EBUSY;
+	return NULL;
+}
+
+/**
+ * Unregisters `reader`, which must not be used afterwards.
+ */
+CBAPI void CBCALL cb_broadcast_leave(struct cb_broadcast_reader *reader)
+{
+	int state = READER_JOINING;
+
+	if (compare_exchange(&reader->state, &state, READER_FREE))
+		fetch_add(&reader->ring->joining, -1);
+	else
+		store_release(&reader->state, READER_FREE);
+}
+
+/*
+ * Starts the readers waiting in cb_broadcast_join at `head`. Only the
+ * producer makes readers active, so it never misses one in its bound.
+ */
+static void _admit_readers(struct cb_broadcast *ring, size_t head)
+{
+	struct cb_broadcast_reader *reader;
+	int i, state;
+
+	for (i = 0; i < ring->max_readers; i++) {
+		reader = &ring->readers[i];
+		if (load_acquire(&reader->state) != READER_JOINING)
+			continue;
+		reader->tail = head;
+		reader->cached_head = head;
+		state = READER_JOINING;
+		/* The reader may be leaving again at the same time. */
+		if (compare_exchange(&reader->state, &state, READER_ACTIVE))
+			fetch_add(&ring->joining, -1);
+	}
+}
+
+/*
+ * Position of the slowest active reader, or head itself without readers.
+ */
+static size_t _slowest_tail(struct cb_broadcast *ring, size_t head)
+{
+	size_t tail, slowest = head;
+	int i;
+
+	for (i = 0; i < ring->max_readers; i++) {
+		if (load_acquire(&ring->readers[i].state) != READER_ACTIVE)
+			continue;
+		tail = load_acquire(&ring->readers[i].tail);
+		if (head - tail > head - slowest)
+			slowest = tail;
+	}
+
+	return slowest;
+}
+
+/**
+ * Writes `amount` bytes for every joined reader to see.
+ *
+ * Only one thread may write. Like cb_write this is all or nothing: when the
+ * slowest reader has not made room for all of `data`, nothing is written.
+ * Without any readers the data is accepted and dropped once overwritten.
+ *
+ * @param ring the ring to write to
+ * @param data the bytes to write
+ * @param amount the number of bytes to write
+ *
+ * @return `amount`, or -1 if there is not enough space.
+ */
+CBAPI ssize_t CBCALL cb_broadcast_write(struct cb_broadcast *ring, char *data,
+		size_t amount)
+{
+	size_t first, head = ring->head, index = head & ring->mask;
+
+	if (amount < 1)
+		return 0;
+	if (load_relaxed(&ring->joining))
+		_admit_readers(ring, head);
+
+	/*
+	 * Readers only move forward and new ones start at head, so the cached
+	 * slowest tail stays a safe lower bound until it runs out.
+	 */
+	if (ring->length - (head - ring->cached_tail) < amount) {
+		ring->cached_tail = _slowest_tail(ring, head);
+		if (ring->length - (head - ring->cached_tail) < amount)
+			return -1;
+	}
+
+	first = ring->length - index;
+	if ((ring->flags & CB_MIRRORED) || first > amount)
+		first = amount;
+	memcpy(ring->buffer + index, data, first);
+	if (first < amount)
+		memcpy(ring->buffer, data + first, amount - first);
+
+	store_release(&ring->head, head + amount);
+
+	return amount;
+}
+
+/**
+ * Exposes the data `reader` has not consumed yet, without copying it. See
+ * cb_read_peek for the meaning of the spans.
+ *
+ * @return The number of readable bytes described by the spans.
+ */
+CBAPI size_t CBCALL cb_broadcast_peek(struct cb_broadcast_reader *reader,
+		char **seg1, size_t *len1, char **seg2, size_t *len2)
+{
+	struct cb_broadcast *ring = reader->ring;
+	size_t first, available, tail, index;
+
+	if (load_acquire(&reader->state) != READER_ACTIVE) {
+		*seg1 = NULL;
+		*len1 = 0;
+		if (seg2 && len2) {
+			*seg2 = NULL;
+			*len2 = 0;
+		}
+		return 0;
+	}
+
+	tail = reader->tail;
+	index = tail & ring->mask;
+	reader->cached_head = load_acquire(&ring->head);
+	available = reader->cached_head - tail;
+
+	first = ring->length - index;
+	if ((ring->flags & CB_MIRRORED) || first > available)
+		first = available;
+
+	*seg1 = ring->buffer + index;
+	*len1 = first;
+	if (seg2 && len2) {
+		*seg2 = ring->buffer;
+		*len2 = available - first;
+		return available;
+	}
+
+	return first;
+}
+
+/**
+ * Releases `amount` bytes for `reader`, letting the producer reuse them once
+ * every other reader has done the same.
+ *
+ * @return `amount`, or -1 if `amount` exceeds the reader's available data.
+ */
+CBAPI ssize_t CBCALL cb_broadcast_consume(struct cb_broadcast_reader *reader,
+		size_t amount)
+{
+	struct cb_broadcast *ring = reader->ring;
+	size_t tail = reader->tail;
+
+	if (amount < 1)
+		return 0;
+	if (load_acquire(&reader->state) != READER_ACTIVE)
+		return -1;
+	if (reader->cached_head - tail < amount) {
+		reader->cached_head = load_acquire(&ring->head);
+		if (reader->cached_head - tail < amount)
+			return -1;
+	}
+
+	store_release(&reader->tail, tail + amount);
+
+	return amount;
+}
+
+/**
+ * Copies up to `amount` bytes for `reader` into `target`.
+ *
+ * @return The number of bytes read.
+ */
+CBAPI ssize_t CBCALL cb_broadcast_read(struct cb_broadcast_reader *reader,
+		char *target, size_t amount)
+{
+	char *seg1, *seg2;
+	size_t len1, len2, available;
+
+	available = cb_broadcast_peek(reader, &seg1, &len1, &seg2, &len2);
+	if (amount > available)
+		amount = available;
+	if (amount < 1)
+		return 0;
+	if (amount <= len1) {
+		memcpy(target, seg1, amount);
+	} else {
+		memcpy(target, seg1, len1);
+		memcpy(target + len1, seg2, amount - len1);
+	}
+
+	return cb_broadcast_consume(reader, amount);
+}
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "circular_buffer.h"
+#include "internal.h"
+
+/*
+ * Bounded multi-producer/multi-consumer queue of fixed-size slots, after
+ * Dmitry Vyukov's design. Every cell carries a sequence number telling
+ * whether it is free for the producer claiming position `pos` (sequence ==
+ * pos) or holds data for the consumer claiming it (sequence == pos + 1).
+ * Producers and consumers only contend on their own position counter, with
+ * a single compare-and-swap per operation and no lock.
+ */
+struct cb_mpmc {
+	char *cells;
+	size_t mask;
+	size_t slot_size;
+	size_t stride; /* sequence number plus slot, rounded to keep alignment */
+
+	CB_CACHELINE size_t enqueue_pos;
+
+	CB_CACHELINE size_t dequeue_pos;
+};
+
+static size_t *_sequence(struct cb_mpmc *ring, size_t pos)
+{
+	return (size_t *)(ring->cells + (pos & ring->mask) * ring->stride);
+}
+
+/**
+ * Creates a queue of at least `slots` elements of `slot_size` bytes each.
+ * `slots` is rounded up to a power of two.
+ *
+ * @param slots the number of elements the queue can hold
+ * @param slot_size the size of one element in bytes
+ *
+ * @return The new queue, or NULL on failure.
+ */
+CBAPI struct cb_mpmc * CBCALL cb_mpmc_create(size_t slots, size_t slot_size)
+{
+#ifdef HAVE_ATOMICS
+	struct cb_mpmc *ring;
+	size_t i, count = 2;
+
+	if (slots < 1 || slot_size < 1 || slots > SIZE_MAX / 4 ||
+			slot_size > SIZE_MAX / 4) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (count < slots)
+		count <<= 1;
+
+	ring = _cb_alloc_aligned(sizeof(struct cb_mpmc));
+	if (!ring)
+		return NULL;
+	memset(ring, 0, sizeof(struct cb_mpmc));
+
+	ring->mask = count - 1;
+	ring->slot_size = slot_size;
+	ring->stride = (sizeof(size_t) + slot_size + sizeof(size_t) - 1)
+		/ sizeof(size_t) * sizeof(size_t);
+	if (ring->stride > SIZE_MAX / count) {
+		errno = EINVAL;
+		goto fail;
+	}
+	ring->cells = _cb_alloc_aligned(count * ring->stride);
+	if (!ring->cells)
+		goto fail;
+
+	for (i = 0; i < count; i++)
+		*_sequence(ring, i) = i;
+
+	return ring;
+fail:
+	_cb_free_aligned(ring);
+	return NULL;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+CBAPI void CBCALL cb_mpmc_destroy(struct cb_mpmc *ring)
+{
+	/* Make sure no other threads are using the queue before destroying it. */
+	_cb_free_aligned(ring->cells);
+	_cb_free_aligned(ring);
+}
+
+/**
+ * Copies one element of `slot_size` bytes from `data` into the queue.
+ *
+ * Safe to call from any number of threads at once.
+ *
+ * @param ring the queue to push to
+ * @param data the element to copy
+ *
+ * @return Zero, or -1 if the queue is full.
+ */
+CBAPI int CBCALL cb_mpmc_push(struct cb_mpmc *ring, char *data)
+{
+	size_t *sequence, pos = load_relaxed(&ring->enqueue_pos);
+	intptr_t diff;
+
+	for (;;) {
+		sequence = _sequence(ring, pos);
+		diff = (intptr_t)load_acquire(sequence) - (intptr_t)pos;
+		if (diff == 0) {
+			/* On failure `pos` is refreshed with the current value. */
+			if (compare_exchange(&ring->enqueue_pos, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = load_relaxed(&ring->enqueue_pos);
+		}
+	}
+
+	memcpy(sequence + 1, data, ring->slot_size);
+	store_release(sequence, pos + 1);
+
+	return 0;
+}
+
+/**
+ * Copies the oldest element of the queue into `target`, which must hold
+ * `slot_size` bytes.
+ *
+ * Safe to call from any number of threads at once.
+ *
+ * @param ring the queue to pop from
+ * @param target location to copy the element to
+ *
+ * @return Zero, or -1 if the queue is empty.
+ */
+CBAPI int CBCALL cb_mpmc_pop(struct cb_mpmc *ring, char *target)
+{
+	size_t *sequence, pos = load_relaxed(&ring->dequeue_pos);
+	intptr_t diff;
+
+	for (;;) {
+		sequence = _sequence(ring, pos);
+		diff = (intptr_t)load_acquire(sequence) - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (compare_exchange(&ring->dequeue_pos, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = load_relaxed(&ring->dequeue_pos);
+		}
+	}
+
+	memcpy(target, sequence + 1, ring->slot_size);
+	/* Hand the cell to the producer one lap ahead. */
+	store_release(sequence, pos + ring->mask + 1);
+
+	return 0;
+}
+
+/**
+ * @return The number of elements the queue can hold.
+ */
+CBAPI size_t CBCALL cb_mpmc_capacity(struct cb_mpmc *ring)
+{
+	return ring->mask + 1;
+}
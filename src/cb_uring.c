@@ -0,0 +1,415 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "circular_buffer.h"
+#include "internal.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Keeps one read pending into the free space of every attached fill buffer
+ * and one write pending from the data of every attached drain buffer, all
+ * through a single io_uring. Completions commit the transferred bytes with
+ * cb_write_commit/cb_read_consume and the next operation is queued on the
+ * following cb_uring_run, so many buffers cost one io_uring_enter per round
+ * instead of a read() or write() each.
+ *
+ * The engine talks to the kernel with raw system calls so it does not need
+ * liburing. Requests are READV/WRITEV over the spans from cb_write_reserve
+ * and cb_read_peek; registered buffers would need one registration per ring
+ * and an extra request whenever the span wraps.
+ */
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+enum {
+	IO_IDLE,
+	IO_PENDING,
+	IO_DONE,
+};
+
+struct cb_uring_io {
+	struct circular_buffer *buffer;
+	int fd;
+	int flags;
+	int state;
+	int error; /* errno of the failed transfer, once IO_DONE */
+	struct iovec iov[2];
+};
+
+struct cb_uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int cq_entries;
+	unsigned int inflight;
+
+	/* Submission queue ring, shared with the kernel. */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+
+	/* Completion queue ring, possibly in the same mapping. */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct cb_uring_io **ios;
+	int nios;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		NULL, 0);
+}
+
+static int map_rings(struct cb_uring *ring, struct io_uring_params *params)
+{
+	char *sq, *cq;
+
+	ring->sq_ring_size = params->sq_off.array
+		+ params->sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params->cq_off.cqes
+		+ params->cq_entries * sizeof(struct io_uring_cqe);
+	if (params->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+
+	sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	ring->sq_ring = sq;
+
+	if (ring->cq_ring_size) {
+		cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -1;
+		ring->cq_ring = cq;
+	} else {
+		cq = sq;
+	}
+
+	ring->sqes = mmap(NULL, params->sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+		IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return -1;
+	}
+
+	ring->sq_head = (unsigned int *)(sq + params->sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params->sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params->sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params->sq_off.array);
+	ring->cq_head = (unsigned int *)(cq + params->cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params->cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+
+	return 0;
+}
+
+static void unmap_rings(struct cb_uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/**
+ * Creates an engine with room for `entries` requests per submission.
+ *
+ * @param entries the submission queue size, rounded up by the kernel
+ *
+ * @return The new engine, or NULL with errno set to ENOSYS if io_uring
+ *         support was not built in or the kernel cannot read and write at
+ *         the current file position, or as set by io_uring_setup().
+ */
+CBAPI struct cb_uring * CBCALL cb_uring_create(unsigned int entries)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct io_uring_params params;
+	struct cb_uring *ring;
+
+	ring = calloc(1, sizeof(struct cb_uring));
+	if (!ring)
+		return NULL;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = io_uring_setup(entries, &params);
+	if (ring->fd < 0)
+		goto fail;
+	/* Pipes and sockets take offset -1 only with IORING_FEAT_RW_CUR_POS. */
+	if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring->fd);
+		errno = ENOSYS;
+		goto fail;
+	}
+	ring->sq_entries = params.sq_entries;
+	ring->cq_entries = params.cq_entries;
+	if (map_rings(ring, &params) < 0)
+		goto fail_rings;
+
+	return ring;
+fail_rings:
+	unmap_rings(ring);
+	close(ring->fd);
+fail:
+	free(ring);
+	return NULL;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+/*
+ * Destroys the engine. Requests still in flight are cancelled by the kernel
+ * when the io_uring is closed, so their buffers must outlive this call.
+ */
+CBAPI void CBCALL cb_uring_destroy(struct cb_uring *ring)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	int i;
+
+	unmap_rings(ring);
+	close(ring->fd);
+	for (i = 0; i < ring->nios; i++)
+		free(ring->ios[i]);
+	free(ring->ios);
+	free(ring);
+#endif
+}
+
+/**
+ * Attaches `buffer` to the descriptor `fd`. With CB_URING_FILL the engine
+ * keeps a read from `fd` pending into the free space of `buffer`, acting as
+ * its only producer. With CB_URING_DRAIN it keeps a write to `fd` pending
+ * from the data of `buffer`, acting as its only consumer.
+ *
+ * @param ring the engine
+ * @param buffer the buffer to fill or drain
+ * @param fd the descriptor to transfer from or to
+ * @param flags CB_URING_FILL or CB_URING_DRAIN
+ *
+ * @return An id for cb_uring_status, or -1 on failure.
+ */
+CBAPI int CBCALL cb_uring_add(struct cb_uring *ring,
+		struct circular_buffer *buffer, int fd, int flags)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct cb_uring_io *io, **ios;
+
+	/* Fills go through cb_write_reserve, which CB_MPSC does not offer. */
+	if ((flags != CB_URING_FILL && flags != CB_URING_DRAIN) ||
+			(flags == CB_URING_FILL && (buffer->flags & CB_MPSC))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* The kernel keeps pointers to the iovecs, so they never move. */
+	io = calloc(1, sizeof(struct cb_uring_io));
+	if (!io)
+		return -1;
+	ios = realloc(ring->ios, (ring->nios + 1) * sizeof(*ios));
+	if (!ios) {
+		free(io);
+		return -1;
+	}
+
+	io->buffer = buffer;
+	io->fd = fd;
+	io->flags = flags;
+	io->state = IO_IDLE;
+	ring->ios = ios;
+	ring->ios[ring->nios] = io;
+
+	return ring->nios++;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/*
+ * Prepares the next request of `io` if its buffer has room or data.
+ * Returns 1 if a submission queue entry was filled in.
+ */
+static int prepare(struct cb_uring *ring, int id, unsigned int tail)
+{
+	struct cb_uring_io *io = ring->ios[id];
+	struct io_uring_sqe *sqe;
+	char *seg1, *seg2;
+	size_t len1, len2;
+	unsigned int index;
+	int op;
+
+	if (io->state != IO_IDLE)
+		return 0;
+
+	if (io->flags == CB_URING_FILL) {
+		if (cb_write_reserve(io->buffer, 1, &seg1, &len1, &seg2, &len2) < 0)
+			return 0;
+		op = IORING_OP_READV;
+	} else {
+		if (cb_read_peek(io->buffer, &seg1, &len1, &seg2, &len2) == 0)
+			return 0;
+		op = IORING_OP_WRITEV;
+	}
+
+	io->iov[0].iov_base = seg1;
+	io->iov[0].iov_len = len1;
+	io->iov[1].iov_base = seg2;
+	io->iov[1].iov_len = len2;
+
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = io->fd;
+	sqe->addr = (unsigned long)io->iov;
+	sqe->len = len2 ? 2 : 1;
+	sqe->off = (__u64)-1; /* current position, see cb_uring_create */
+	sqe->user_data = id;
+	ring->sq_array[index] = index;
+	io->state = IO_PENDING;
+
+	return 1;
+}
+
+static void complete(struct cb_uring *ring, struct io_uring_cqe *cqe)
+{
+	struct cb_uring_io *io = ring->ios[cqe->user_data];
+
+	ring->inflight--;
+	io->state = IO_IDLE;
+	if (cqe->res < 0) {
+		if (cqe->res == -EAGAIN || cqe->res == -EINTR)
+			return;
+		io->error = -cqe->res;
+		io->state = IO_DONE;
+	} else if (cqe->res == 0) {
+		/* End of file, or a descriptor that will not take more. */
+		io->state = IO_DONE;
+	} else if (io->flags == CB_URING_FILL) {
+		cb_write_commit(io->buffer, cqe->res);
+	} else {
+		cb_read_consume(io->buffer, cqe->res);
+	}
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/**
+ * Queues a request for every attached buffer that has none pending and has
+ * room (fill) or data (drain), submits them all with one io_uring_enter and
+ * waits for up to `wait` completions. Every completion moves head or tail
+ * of its buffer.
+ *
+ * @param ring the engine
+ * @param wait the number of completions to wait for, capped at the number of
+ *        requests in flight
+ *
+ * @return The number of completions handled, or -1 on failure.
+ */
+CBAPI int CBCALL cb_uring_run(struct cb_uring *ring, unsigned int wait)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	unsigned int head, tail, unsubmitted, queued = 0;
+	int i, ret, handled = 0;
+
+	/*
+	 * Entries a failed or short io_uring_enter left behind are still
+	 * between sq_head and sq_tail; they are submitted again with the new
+	 * ones and only count as in flight once the kernel took them.
+	 */
+	tail = *ring->sq_tail;
+	unsubmitted = tail - load_acquire(ring->sq_head);
+	for (i = 0; i < ring->nios; i++) {
+		if (unsubmitted + queued == ring->sq_entries || ring->inflight
+				+ unsubmitted + queued == ring->cq_entries)
+			break;
+		queued += prepare(ring, i, tail + queued);
+	}
+	store_release(ring->sq_tail, tail + queued);
+	unsubmitted += queued;
+
+	if (wait > ring->inflight + unsubmitted)
+		wait = ring->inflight + unsubmitted;
+	if (unsubmitted || wait) {
+		do {
+			ret = io_uring_enter(ring->fd, unsubmitted, wait,
+				wait ? IORING_ENTER_GETEVENTS : 0);
+		} while (ret < 0 && errno == EINTR);
+		if (ret < 0)
+			return -1;
+		ring->inflight += ret;
+	}
+
+	head = *ring->cq_head;
+	while (head != load_acquire(ring->cq_tail)) {
+		complete(ring, &ring->cqes[head & *ring->cq_mask]);
+		head++;
+		handled++;
+	}
+	store_release(ring->cq_head, head);
+
+	return handled;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * @return Zero while the attachment `id` is active, 1 once it reached end of
+ *         file, or -1 with errno set to the error that ended it.
+ */
+CBAPI int CBCALL cb_uring_status(struct cb_uring *ring, int id)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	struct cb_uring_io *io = ring->ios[id];
+
+	if (io->state != IO_DONE)
+		return 0;
+	if (io->error) {
+		errno = io->error;
+		return -1;
+	}
+	return 1;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
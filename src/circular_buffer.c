@@ -1,244 +1,2601 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memfd_create */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
 
-#ifdef WIN32
-#else
-#include <unistd.h>
-#endif
+#ifdef WIN32
+#else
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
+#include <limits.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#endif
+
+#include "circular_buffer.h"
+#include "internal.h"
+
+/*
+ * USDT probes for bpftrace, perf and SystemTap, named
+ * circular_buffer:<name>. An unattached probe is a nop, and the semaphore
+ * the tracer bumps on attaching keeps the arguments from being computed
+ * until then. Without sys/sdt.h they compile away.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define PROBE_SEMAPHORE(name) unsigned short circular_buffer_##name##_semaphore \
+	__attribute__((unused)) __attribute__((section(".probes")))
+#define probe_enabled(name) \
+	(*(volatile unsigned short *)&circular_buffer_##name##_semaphore != 0)
+#define probe2(name, a, b) DTRACE_PROBE2(circular_buffer, name, a, b)
+#define probe3(name, a, b, c) DTRACE_PROBE3(circular_buffer, name, a, b, c)
+#else
+#define PROBE_SEMAPHORE(name) extern int cb_no_probes
+#define probe_enabled(name) 0
+/* Only ever reached behind probe_enabled(), so the arguments are dead. */
+#define probe2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#define probe3(name, a, b, c) do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+PROBE_SEMAPHORE(write); /* buffer, bytes written, bytes held after */
+PROBE_SEMAPHORE(read); /* buffer, bytes read, bytes held after */
+PROBE_SEMAPHORE(write_rejected); /* buffer, bytes needed, bytes free */
+PROBE_SEMAPHORE(read_empty); /* buffer, bytes needed, bytes held */
+PROBE_SEMAPHORE(clear); /* buffer, bytes discarded */
+
+/*
+ * In CB_SPSC mode the producer is the only writer of head and the consumer
+ * the only writer of tail. Each side publishes its index with release
+ * semantics and loads the other side's index with acquire semantics, so the
+ * bytes covered by an index are visible before the index itself.
+ */
+static int lockfree(struct circular_buffer *buffer)
+{
+#ifdef HAVE_ATOMICS
+	return buffer->flags & (CB_SPSC | CB_MPSC);
+#else
+	return 0;
+#endif
+}
+
+static int mpsc(struct circular_buffer *buffer)
+{
+#ifdef HAVE_ATOMICS
+	return buffer->flags & CB_MPSC;
+#else
+	return 0;
+#endif
+}
+
+static int mirrored(struct circular_buffer *buffer)
+{
+	return buffer->flags & CB_MIRRORED;
+}
+
+static int pow2(struct circular_buffer *buffer)
+{
+	return buffer->flags & CB_POW2;
+}
+
+static int overwrite(struct circular_buffer *buffer)
+{
+	return buffer->flags & CB_OVERWRITE;
+}
+
+static int shared(struct circular_buffer *buffer)
+{
+	return buffer->flags & CB_SHM;
+}
+
+static int page_granular(struct circular_buffer *buffer)
+{
+	return buffer->flags & (CB_MIRRORED | CB_PAGE_ALIGNED);
+}
+
+static int stats(struct circular_buffer *buffer)
+{
+	return buffer->flags & CB_STATS;
+}
+
+/*
+ * Start of the storage. It is kept as an offset from the struct so that a
+ * buffer in shared memory works wherever each process maps it.
+ */
+static char *_data(struct circular_buffer *buffer)
+{
+	return (char *)((uintptr_t)buffer + buffer->data_offset);
+}
+
+/*
+ * Positions are either indexes in 0..length (wrapping at length + 1, the
+ * extra byte tells full from empty) or, in CB_POW2 mode, free-running
+ * counters that are masked on access. The mask is all ones in the former
+ * case, so _index() never branches.
+ */
+static size_t _storage(struct circular_buffer *buffer)
+{
+	return pow2(buffer) ? buffer->length : buffer->length + 1;
+}
+
+static size_t _index(struct circular_buffer *buffer, size_t pos)
+{
+	return pos & buffer->mask;
+}
+
+static size_t _advance(struct circular_buffer *buffer, size_t pos, size_t amount)
+{
+	if (pow2(buffer))
+		return pos + amount;
+	return (pos + amount) % (buffer->length + 1);
+}
+
+static size_t _distance(struct circular_buffer *buffer, size_t tail, size_t head)
+{
+	size_t available = 0;
+
+	if (pow2(buffer))
+		available = head - tail;
+	else if (head == tail)
+		available = 0;
+	else if (tail < head)
+		available = head - tail;
+	else
+		available = (buffer->length + 1) - tail + head;
+
+	return available;
+}
+
+static size_t _available_data(struct circular_buffer *buffer)
+{
+	return _distance(buffer, load_acquire(&buffer->tail),
+		load_acquire(&buffer->head));
+}
+
+/*
+ * Returns how many of the `amount` bytes starting at position `from` can be
+ * reached without wrapping to the start of the storage.
+ */
+static size_t _contiguous(struct circular_buffer *buffer, size_t from, size_t amount)
+{
+	size_t until_end = _storage(buffer) - _index(buffer, from);
+
+	if (mirrored(buffer) || until_end >= amount)
+		return amount;
+	return until_end;
+}
+
+/* Copies `amount` bytes into the storage at position `pos`, wrapping. */
+static void _copy_in(struct circular_buffer *buffer, size_t pos, char *data,
+		size_t amount)
+{
+	size_t first = _contiguous(buffer, pos, amount);
+
+	memcpy(_data(buffer) + _index(buffer, pos), data, first);
+	if (first < amount)
+		memcpy(_data(buffer), data + first, amount - first);
+}
+
+/* Copies `amount` bytes out of the storage from position `pos`, wrapping. */
+static void _copy_out(struct circular_buffer *buffer, size_t pos, char *target,
+		size_t amount)
+{
+	size_t first = _contiguous(buffer, pos, amount);
+
+	memcpy(target, _data(buffer) + _index(buffer, pos), first);
+	if (first < amount)
+		memcpy(target + first, _data(buffer), amount - first);
+}
+
+static size_t _available_space(struct circular_buffer *buffer)
+{
+	return buffer->length - _available_data(buffer);
+}
+
+/*
+ * Free space as seen by the producer. The consumer's tail is only loaded
+ * again when the cached copy shows fewer than `want` bytes free, so a
+ * producer running ahead of the consumer does not touch its cache line.
+ */
+static size_t _producer_space(struct circular_buffer *buffer, size_t head,
+		size_t want)
+{
+	size_t space = buffer->length
+		- _distance(buffer, buffer->cached_tail, head);
+
+	if (space < want) {
+		buffer->cached_tail = load_acquire(&buffer->tail);
+		space = buffer->length
+			- _distance(buffer, buffer->cached_tail, head);
+	}
+
+	return space;
+}
+
+/*
+ * Available data as seen by the consumer, the mirror image of
+ * _producer_space().
+ */
+static size_t _consumer_data(struct circular_buffer *buffer, size_t tail,
+		size_t want)
+{
+	size_t available = _distance(buffer, tail, buffer->cached_head);
+
+	if (available < want) {
+		buffer->cached_head = load_acquire(&buffer->head);
+		available = _distance(buffer, tail, buffer->cached_head);
+	}
+
+	return available;
+}
+
+size_t _cb_page_size(void)
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/* The struct needs cache line alignment, which calloc does not promise. */
+void *_cb_alloc_aligned(size_t size)
+{
+#ifdef WIN32
+	return _aligned_malloc(size, CB_CACHELINE_SIZE);
+#else
+	void *ptr;
+	if (posix_memalign(&ptr, CB_CACHELINE_SIZE, size) != 0)
+		return NULL;
+	return ptr;
+#endif
+}
+
+void _cb_free_aligned(void *ptr)
+{
+#ifdef WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Maps the first `header` bytes of `fd` followed by the `size` bytes after
+ * them twice, back to back, so that reading or writing past the end of the
+ * first copy lands at its start again. `header` and `size` must be
+ * multiples of the page size.
+ */
+static char *map_mirrored(int fd, size_t header, size_t size)
+{
+	char *addr;
+
+	/* Reserve the address range first so all parts end up adjacent. */
+	addr = mmap(NULL, header + 2 * size, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+	if (header && mmap(addr, header, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+		goto fail;
+	if (mmap(addr + header, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, header) == MAP_FAILED)
+		goto fail;
+	if (mmap(addr + header + size, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, fd, header) == MAP_FAILED)
+		goto fail;
+
+	return addr;
+fail:
+	munmap(addr, header + 2 * size);
+	return NULL;
+}
+#endif
+
+/*
+ * Maps `size` bytes of anonymous shared memory twice, back to back. `size`
+ * must be a multiple of the page size.
+ */
+char *_cb_mirror_map(size_t size)
+{
+#ifdef __linux__
+	char *addr = NULL;
+	int fd = memfd_create("circular_buffer", MFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, size) == 0)
+		addr = map_mirrored(fd, 0, size);
+	close(fd);
+	return addr;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+void _cb_mirror_unmap(char *addr, size_t size)
+{
+#ifdef __linux__
+	munmap(addr, 2 * size);
+#endif
+}
+
+static char *alloc_storage(struct circular_buffer *buffer)
+{
+	char *storage;
+
+	if (mirrored(buffer))
+		return _cb_mirror_map(_storage(buffer));
+	if (!(buffer->flags & CB_PAGE_ALIGNED))
+		return calloc(_storage(buffer), sizeof(char));
+
+#ifdef WIN32
+	storage = _aligned_malloc(_storage(buffer), _cb_page_size());
+	if (!storage)
+		return NULL;
+	memset(storage, 0, _storage(buffer));
+#else
+	/* Mapped rather than allocated so cb_splice_out can swap its pages. */
+	storage = mmap(NULL, _storage(buffer), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (storage == MAP_FAILED)
+		return NULL;
+#endif
+	return storage;
+}
+
+static void free_storage(struct circular_buffer *buffer)
+{
+	if (mirrored(buffer))
+		_cb_mirror_unmap(buffer->buffer, _storage(buffer));
+#ifdef WIN32
+	else if (buffer->flags & CB_PAGE_ALIGNED)
+		_aligned_free(buffer->buffer);
+#else
+	else if (buffer->flags & CB_PAGE_ALIGNED)
+		munmap(buffer->buffer, _storage(buffer));
+#endif
+	else
+		free(buffer->buffer);
+}
+
+static void yield_cpu(void)
+{
+#ifdef WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+static long long now_ns(void)
+{
+#ifdef WIN32
+	return (long long)GetTickCount64() * 1000000;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+#ifdef CB_LOCK_PROFILE
+/* Bucket of a wait of `ns` nanoseconds: floor(log2(ns)), clamped. */
+static int profile_bucket(long long ns)
+{
+	int bucket = 0;
+
+	while (ns > 1 && bucket < CB_LOCK_BUCKETS - 1) {
+		ns >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/* Called with the mutex held, `blocked` is -1 if it was free. */
+static void profile_lock(struct cb_lock_profile *profile, long long blocked)
+{
+	int bucket;
+
+	store_relaxed(&profile->acquisitions, profile->acquisitions + 1);
+	if (blocked < 0)
+		return;
+	bucket = profile_bucket(blocked);
+	store_relaxed(&profile->contended, profile->contended + 1);
+	store_relaxed(&profile->blocked_ns, profile->blocked_ns + blocked);
+	store_relaxed(&profile->blocked[bucket], profile->blocked[bucket] + 1);
+}
+#endif
+
+static int profiled(struct circular_buffer *buffer)
+{
+#ifdef CB_LOCK_PROFILE
+	return buffer->lock_profile != NULL;
+#else
+	(void)buffer;
+	return 0;
+#endif
+}
+
+/*
+ * With CB_STATS or a lock profile the mutex is tried first, so a contended
+ * acquisition can be told from a free one. Otherwise it is a plain lock.
+ */
+static void lock(struct circular_buffer *buffer)
+{
+#ifdef CB_LOCK_PROFILE
+	long long start = 0;
+#endif
+
+	if (lockfree(buffer))
+		return;
+	if (!stats(buffer) && !profiled(buffer)) {
+#ifdef WIN32
+		WaitForSingleObject(buffer->mutex, INFINITE);
+#else /* Unix */
+		pthread_mutex_lock(&buffer->mutex);
+#endif
+		return;
+	}
+
+#ifdef WIN32
+	if (WaitForSingleObject(buffer->mutex, 0) != WAIT_TIMEOUT) {
+#else /* Unix */
+	if (pthread_mutex_trylock(&buffer->mutex) == 0) {
+#endif
+#ifdef CB_LOCK_PROFILE
+		if (buffer->lock_profile)
+			profile_lock(buffer->lock_profile, -1);
+#endif
+		return;
+	}
+
+#ifdef CB_LOCK_PROFILE
+	if (buffer->lock_profile)
+		start = now_ns();
+#endif
+#ifdef WIN32
+	WaitForSingleObject(buffer->mutex, INFINITE);
+#else /* Unix */
+	pthread_mutex_lock(&buffer->mutex);
+#endif
+	if (stats(buffer))
+		store_relaxed(&buffer->stat_lock_contended,
+			buffer->stat_lock_contended + 1);
+#ifdef CB_LOCK_PROFILE
+	if (buffer->lock_profile)
+		profile_lock(buffer->lock_profile, now_ns() - start);
+#endif
+}
+
+static void unlock(struct circular_buffer *buffer)
+{
+	if (lockfree(buffer))
+		return;
+#ifdef WIN32
+	ReleaseMutex(buffer->mutex);
+#else /* Unix */
+	pthread_mutex_unlock(&buffer->mutex);
+#endif
+}
+
+/*
+ * Sleeps while `*seq` still equals `val`, for at most `timeout_ns`. Without
+ * futexes this degrades to a short sleep and the caller re-checks. Buffers
+ * in shared memory need the slower non-private futex operations so that
+ * other processes can wake us.
+ */
+static void futex_wait(struct circular_buffer *buffer, unsigned int *seq,
+		unsigned int val, long long timeout_ns)
+{
+#ifdef __linux__
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ns / 1000000000;
+	timeout.tv_nsec = timeout_ns % 1000000000;
+	syscall(SYS_futex, seq, shared(buffer) ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE,
+		val, timeout_ns < 0 ? NULL : &timeout, NULL, 0);
+#elif defined(WIN32)
+	Sleep(1);
+#else
+	usleep(50);
+#endif
+}
+
+static void futex_wake(struct circular_buffer *buffer, unsigned int *seq)
+{
+#ifdef __linux__
+	syscall(SYS_futex, seq, shared(buffer) ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE,
+		INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/*
+ * Wakes the threads parked on `seq`, if there are any. The fence orders the
+ * index the caller just published before the load of `waiters`, pairing with
+ * the fetch_add in park(), so either the waiter sees the new index or we see
+ * the waiter. With nobody parked this never enters the kernel.
+ */
+static void wake(struct circular_buffer *buffer, int *waiters, unsigned int *seq)
+{
+	full_fence();
+	if (load_acquire(waiters) == 0)
+		return;
+	fetch_add(seq, 1);
+	futex_wake(buffer, seq);
+}
+
+/*
+ * Keeps the eventfd `fd` readable while `level(buffer)` is at least
+ * `threshold`. `signalled` coalesces notifications: a burst of writes only
+ * bumps the eventfd once, and it is drained once the level drops again. A
+ * lock-free producer and consumer may race here, which can leave a spurious
+ * wake-up behind, never a lost one: the drain may swallow the other side's
+ * notification, so whoever drains writes again unconditionally when the
+ * level is back up.
+ */
+static void update_event(struct circular_buffer *buffer, int fd,
+		int *signalled, size_t threshold,
+		size_t (*level)(struct circular_buffer *))
+{
+#ifdef __linux__
+	eventfd_t value;
+
+	if (level(buffer) >= threshold) {
+		if (exchange(signalled, 1) == 0)
+			eventfd_write(fd, 1);
+	} else if (exchange(signalled, 0) == 1) {
+		eventfd_read(fd, &value);
+		/* The other side may have crossed the threshold meanwhile. */
+		if (level(buffer) >= threshold) {
+			store_release(signalled, 1);
+			eventfd_write(fd, 1);
+		}
+	}
+#endif
+}
+
+static void update_events(struct circular_buffer *buffer)
+{
+	int fd;
+
+	if ((fd = load_acquire(&buffer->read_fd)) >= 0)
+		update_event(buffer, fd, &buffer->read_signalled,
+			load_acquire(&buffer->read_threshold), _available_data);
+	if ((fd = load_acquire(&buffer->write_fd)) >= 0)
+		update_event(buffer, fd, &buffer->write_signalled,
+			load_acquire(&buffer->write_threshold), _available_space);
+}
+
+/*
+ * Adds `amount` to a CB_STATS counter. Only CB_MPSC producers update their
+ * side's counters concurrently; everywhere else one thread at a time does,
+ * so a plain relaxed store is enough and cb_get_stats never sees a torn
+ * value.
+ */
+static void count(struct circular_buffer *buffer, size_t *counter, size_t amount)
+{
+	if (mpsc(buffer))
+		fetch_add(counter, amount);
+	else
+		store_relaxed(counter, load_relaxed(counter) + amount);
+}
+
+/*
+ * Counts a write moving head to `head`. Heads are published one at a time
+ * in every mode, CB_MPSC producers included, so the write counters and the
+ * high-water mark are only ever updated by the thread publishing.
+ */
+static void count_write(struct circular_buffer *buffer, size_t head)
+{
+	size_t fill = _distance(buffer, load_acquire(&buffer->tail), head);
+
+	store_relaxed(&buffer->stat_writes, buffer->stat_writes + 1);
+	store_relaxed(&buffer->stat_bytes_written, buffer->stat_bytes_written
+		+ _distance(buffer, buffer->head, head));
+	if (fill > buffer->stat_high_water)
+		store_relaxed(&buffer->stat_high_water, fill);
+}
+
+static void count_read(struct circular_buffer *buffer, size_t tail)
+{
+	store_relaxed(&buffer->stat_reads, buffer->stat_reads + 1);
+	store_relaxed(&buffer->stat_bytes_read, buffer->stat_bytes_read
+		+ _distance(buffer, buffer->tail, tail));
+}
+
+/*
+ * CB_LATENCY keeps a side ring of (end position, time) stamps, one per
+ * published write. Like head itself stamps are pushed one at a time, and
+ * only the consumer retires them, so the side ring is single producer,
+ * single consumer in every mode. A write finding the side ring full goes
+ * unstamped and its bytes are timed with the next stamped write.
+ */
+#define LATENCY_STAMPS 1024
+
+struct cb_residence {
+	CB_CACHELINE size_t head;
+	CB_CACHELINE size_t tail;
+	struct cb_latency histogram; /* written by the consumer */
+	struct {
+		size_t end;
+		long long ns;
+	} stamps[LATENCY_STAMPS];
+};
+
+static void stamp_write(struct circular_buffer *buffer, size_t head)
+{
+	struct cb_residence *residence = buffer->residence;
+	size_t slot = residence->head;
+
+	if (slot - load_acquire(&residence->tail) == LATENCY_STAMPS)
+		return;
+	residence->stamps[slot % LATENCY_STAMPS].end = head;
+	residence->stamps[slot % LATENCY_STAMPS].ns = now_ns();
+	store_release(&residence->head, slot + 1);
+}
+
+static size_t latency_bucket(unsigned long long ns)
+{
+	unsigned long long sub = 1ULL << CB_LATENCY_SUB_BITS;
+	size_t bucket;
+	int exponent = CB_LATENCY_SUB_BITS;
+
+	if (ns < sub)
+		return (size_t)ns;
+	while (ns >> (exponent + 1))
+		exponent++;
+	bucket = (exponent - CB_LATENCY_SUB_BITS + 1) * sub
+		+ ((ns >> (exponent - CB_LATENCY_SUB_BITS)) & (sub - 1));
+
+	return bucket < CB_LATENCY_BUCKETS ? bucket : CB_LATENCY_BUCKETS - 1;
+}
+
+static void record_latency(struct cb_latency *histogram, unsigned long long ns)
+{
+	size_t bucket = latency_bucket(ns);
+
+	store_relaxed(&histogram->count, histogram->count + 1);
+	store_relaxed(&histogram->total_ns, histogram->total_ns + ns);
+	if (ns > histogram->max_ns)
+		store_relaxed(&histogram->max_ns, ns);
+	store_relaxed(&histogram->buckets[bucket], histogram->buckets[bucket] + 1);
+}
+
+/*
+ * Retires the stamps of writes that end at or before `tail`, recording how
+ * long they waited unless their data was dropped rather than read. Called
+ * before tail moves there.
+ */
+static void stamp_read(struct circular_buffer *buffer, size_t tail, int record)
+{
+	struct cb_residence *residence = buffer->residence;
+	size_t slot = residence->tail, head = load_acquire(&residence->head);
+	size_t consumed = _distance(buffer, buffer->tail, tail);
+	long long now = record ? now_ns() : 0;
+
+	for (; slot != head; slot++) {
+		if (_distance(buffer, buffer->tail,
+				residence->stamps[slot % LATENCY_STAMPS].end) > consumed)
+			break;
+		if (record)
+			record_latency(&residence->histogram,
+				now - residence->stamps[slot % LATENCY_STAMPS].ns);
+	}
+	store_release(&residence->tail, slot);
+}
+
+/*
+ * move_head/move_tail make a new index visible and wake whoever waits on
+ * it. publish_head/publish_tail do the same for data actually written or
+ * read, which CB_STATS counts; dropping data and clearing only move.
+ */
+static void move_head(struct circular_buffer *buffer, size_t head)
+{
+	store_release(&buffer->head, head);
+	wake(buffer, &buffer->read_waiters, &buffer->read_seq);
+	update_events(buffer);
+}
+
+static void move_tail(struct circular_buffer *buffer, size_t tail)
+{
+	store_release(&buffer->tail, tail);
+	wake(buffer, &buffer->write_waiters, &buffer->write_seq);
+	update_events(buffer);
+}
+
+static void publish_head(struct circular_buffer *buffer, size_t head)
+{
+	if (probe_enabled(write))
+		probe3(write, buffer, _distance(buffer, buffer->head, head),
+			_distance(buffer, load_acquire(&buffer->tail), head));
+	if (stats(buffer))
+		count_write(buffer, head);
+	if (buffer->residence)
+		stamp_write(buffer, head);
+	move_head(buffer, head);
+}
+
+static void publish_tail(struct circular_buffer *buffer, size_t tail)
+{
+	if (probe_enabled(read))
+		probe3(read, buffer, _distance(buffer, buffer->tail, tail),
+			_distance(buffer, tail, load_acquire(&buffer->head)));
+	if (stats(buffer))
+		count_read(buffer, tail);
+	if (buffer->residence)
+		stamp_read(buffer, tail, 1);
+	move_tail(buffer, tail);
+}
+
+/* A write of `want` bytes found only `space` free and stored nothing. */
+static void reject_write(struct circular_buffer *buffer, size_t want,
+		size_t space)
+{
+	if (probe_enabled(write_rejected))
+		probe3(write_rejected, buffer, want, space);
+	if (stats(buffer))
+		count(buffer, &buffer->stat_writes_rejected, 1);
+}
+
+static void close_splice_pipe(struct circular_buffer *buffer)
+{
+	if (buffer->splice_fds[0] >= 0) {
+		close(buffer->splice_fds[0]);
+		close(buffer->splice_fds[1]);
+	}
+	buffer->splice_fds[0] = -1;
+	buffer->splice_fds[1] = -1;
+	buffer->splice_pending = 0;
+}
+
+static int check_flags(size_t length, int flags)
+{
+	/*
+	 * Keep every size representable as ssize_t, which also leaves room for
+	 * the extra byte, the power of two round up and the page round up.
+	 */
+	if (length > (size_t)SSIZE_MAX / 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* The producer moves tail when overwriting, which needs the mutex. */
+	if ((flags & CB_OVERWRITE) && (flags & (CB_SPSC | CB_MPSC))) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Fills in a zeroed `buffer` for `length` bytes, rounding the length up as
+ * the flags ask. The storage and the mutex are left to the caller.
+ */
+static void setup(struct circular_buffer *buffer, size_t length, int flags)
+{
+	buffer->length = length;
+	buffer->tail = 0;
+	buffer->head = 0;
+	if (flags & CB_MPSC)
+		flags |= CB_POW2;
+
+	buffer->flags = flags;
+	buffer->mask = -1;
+	buffer->read_fd = -1;
+	buffer->write_fd = -1;
+	buffer->splice_fds[0] = -1;
+	buffer->splice_fds[1] = -1;
+	buffer->read_threshold = 1;
+	buffer->write_threshold = 1;
+	if (pow2(buffer)) {
+		buffer->length = 1;
+		while (buffer->length < length)
+			buffer->length <<= 1;
+		if (page_granular(buffer) && buffer->length < _cb_page_size())
+			buffer->length = _cb_page_size();
+		buffer->mask = buffer->length - 1;
+	}
+	if (page_granular(buffer)) {
+		size_t page = _cb_page_size();
+		buffer->length = (_storage(buffer) + page - 1) / page * page
+			- (_storage(buffer) - buffer->length);
+	}
+}
+
+static void init_mutex(struct circular_buffer *buffer)
+{
+#ifdef WIN32
+	buffer->mutex = CreateMutex(
+		NULL,   /* default security attributes */
+		FALSE,  /* initially not owned */
+		NULL);  /* unnamed mutex */
+#else /* Unix */
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+	if (shared(buffer))
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&buffer->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+#endif
+}
+
+/**
+ * Creates a buffer able to hold `length` bytes.
+ *
+ * `flags` is a combination of the CB_* creation flags. With CB_SPSC the
+ * mutex is skipped on cb_read/cb_write and friends, which is only safe when
+ * exactly one thread writes and exactly one thread reads. cb_clear and
+ * cb_debug are not synchronized in that mode.
+ *
+ * With CB_MIRRORED the storage is mapped twice in a row, so every readable
+ * or writable region is one contiguous span starting at cb_starts_at or
+ * cb_ends_at. The storage is rounded up to whole pages, so `length` may grow.
+ *
+ * With CB_PAGE_ALIGNED the storage starts on a page boundary and is rounded
+ * up to whole pages the same way, so cb_splice_out only ever hands the
+ * kernel pages that belong to the buffer.
+ *
+ * With CB_POW2 `length` is rounded up to a power of two and head and tail
+ * become free-running counters: indexing is a mask, the available data is
+ * head - tail, and no byte is kept unused to tell a full buffer from an
+ * empty one.
+ *
+ * With CB_MPSC any number of threads may write while one thread reads.
+ * Writers claim their byte range with a compare-and-swap on a reservation
+ * counter and copy without holding a lock, but publish head strictly in
+ * claim order: a writer waits, yielding, until every earlier claim is
+ * published. This is not lock-free. A writer preempted between its claim
+ * and its publish stalls the writers that claimed after it, though never
+ * the reader. CB_MPSC implies CB_POW2 so the counters never repeat. The
+ * zero-copy write calls are not available in this mode, and like with
+ * CB_SPSC cb_clear and cb_debug need every writer to be idle, as writers
+ * never take the mutex.
+ *
+ * With CB_OVERWRITE cb_write never fails: when the data does not fit, tail
+ * is moved past the oldest bytes to make room, and only the last `length`
+ * bytes of a larger write are kept. The number of bytes lost this way is
+ * reported by cb_dropped. Data exposed by cb_read_peek can be overwritten
+ * before it is consumed, so zero-copy readers should check cb_dropped
+ * before trusting it. The mode relies on the mutex, so it cannot be
+ * combined with CB_SPSC or CB_MPSC.
+ *
+ * With CB_STATS the buffer counts its traffic for cb_get_stats. The
+ * counters sit on cache lines of their own per side, so they cost a few
+ * stores per call and no extra sharing between producer and consumer.
+ *
+ * With CB_LATENCY every write is timestamped and the time until its last
+ * byte is read goes into the histogram returned by cb_get_latency. Bytes
+ * dropped by CB_OVERWRITE or cb_clear are not counted.
+ *
+ * @param length the number of bytes the buffer can hold
+ * @param flags CB_* creation flags
+ *
+ * @return The new buffer or NULL on failure.
+ */
+CBAPI struct circular_buffer * CBCALL cb_create_flags(size_t length, int flags)
+{
+	struct circular_buffer *buffer;
+
+	if (check_flags(length, flags) < 0)
+		return NULL;
+
+	buffer = _cb_alloc_aligned(sizeof(struct circular_buffer));
+	if (!buffer)
+		return NULL;
+	memset(buffer, 0, sizeof(struct circular_buffer));
+
+	setup(buffer, length, flags & ~CB_SHM);
+	buffer->buffer = alloc_storage(buffer);
+	if (!buffer->buffer) goto fail;
+	buffer->data_offset = (uintptr_t)buffer->buffer - (uintptr_t)buffer;
+
+	if (flags & CB_LATENCY) {
+		buffer->residence = _cb_alloc_aligned(sizeof(struct cb_residence));
+		if (!buffer->residence) goto fail_storage;
+		memset(buffer->residence, 0, sizeof(struct cb_residence));
+	}
+
+#ifdef CB_LOCK_PROFILE
+	if (!lockfree(buffer)) {
+		buffer->lock_profile = calloc(1, sizeof(struct cb_lock_profile));
+		if (!buffer->lock_profile) goto fail_residence;
+	}
+#endif
+
+	init_mutex(buffer);
+
+	return buffer;
+#ifdef CB_LOCK_PROFILE
+fail_residence:
+	_cb_free_aligned(buffer->residence);
+#endif
+fail_storage:
+	free_storage(buffer);
+fail:
+	_cb_free_aligned(buffer);
+	return NULL;
+}
+
+CBAPI struct circular_buffer * CBCALL cb_create64(size_t length)
+{
+	return cb_create_flags(length, 0);
+}
+
+CBAPI struct circular_buffer * CBCALL cb_create(int length)
+{
+	if (length < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return cb_create_flags(length, 0);
+}
+
+CBAPI struct circular_buffer * CBCALL cb_create_spsc(int length)
+{
+	if (length < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return cb_create_flags(length, CB_SPSC);
+}
+
+CBAPI void CBCALL cb_destroy(struct circular_buffer *buffer)
+{
+#ifdef __linux__
+	/* Other processes may still use the mutex and the data. */
+	if (shared(buffer)) {
+		munmap(buffer, buffer->data_offset + 2 * _storage(buffer));
+		return;
+	}
+#endif
+	/* Make sure no other threads are using the buffer before destroying it. */
+#ifdef WIN32
+	CloseHandle(buffer->mutex);
+#else
+	pthread_mutex_destroy(&buffer->mutex);
+#endif
+	if (buffer->read_fd >= 0)
+		close(buffer->read_fd);
+	if (buffer->write_fd >= 0)
+		close(buffer->write_fd);
+	close_splice_pipe(buffer);
+	free_storage(buffer);
+	free(buffer->lock_profile);
+	_cb_free_aligned(buffer->residence);
+	_cb_free_aligned(buffer);
+}
+
+#define CB_SHM_MAGIC 0x63627334 /* "cbs4", bump when the layout changes */
+
+/* The header takes whole pages so the storage behind it stays aligned. */
+static size_t shm_header_size(void)
+{
+	size_t page = _cb_page_size();
+	return (sizeof(struct circular_buffer) + page - 1) / page * page;
+}
+
+/**
+ * Creates a buffer in the POSIX shared memory object `name`, which other
+ * processes attach to with cb_open_shm.
+ *
+ * The object holds the struct in its first pages, followed by the storage,
+ * which every process maps twice as with CB_MIRRORED. The storage is found
+ * through an offset, so `buffer->buffer` is NULL; use cb_starts_at and
+ * cb_ends_at or the zero-copy calls instead. The mutex and the futexes used
+ * by cb_read_wait/cb_write_wait work across processes, and the CB_SPSC and
+ * CB_MPSC modes need nothing but the shared atomics. Eventfds and
+ * cb_splice_out are not available since descriptors are per process.
+ *
+ * @param name the shared memory object to create, like "/capture"
+ * @param length the number of bytes the buffer can hold
+ * @param flags CB_* creation flags
+ *
+ * @return The new buffer, or NULL with errno set (EEXIST if `name` is
+ *         already in use).
+ */
+CBAPI struct circular_buffer * CBCALL cb_create_shm(const char *name,
+		size_t length, int flags)
+{
+#ifdef __linux__
+	struct circular_buffer layout, *buffer;
+	size_t header = shm_header_size();
+	int fd;
+
+	if (check_flags(length, flags) < 0)
+		return NULL;
+	/* The timestamps live in private memory. */
+	if (flags & CB_LATENCY) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	memset(&layout, 0, sizeof(layout));
+	setup(&layout, length,
+		(flags & ~CB_PAGE_ALIGNED) | CB_MIRRORED | CB_SHM);
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, header + _storage(&layout)) < 0)
+		goto fail;
+	buffer = (struct circular_buffer *)map_mirrored(fd, header,
+		_storage(&layout));
+	if (!buffer)
+		goto fail;
+	close(fd);
+
+	memcpy(buffer, &layout, sizeof(layout));
+	buffer->buffer = NULL;
+	buffer->data_offset = header;
+	init_mutex(buffer);
+	/* cb_open_shm refuses the buffer until this is visible. */
+	store_release(&buffer->magic, CB_SHM_MAGIC);
+
+	return buffer;
+fail:
+	close(fd);
+	shm_unlink(name);
+	return NULL;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+/**
+ * Attaches to the buffer another process created with cb_create_shm.
+ * cb_destroy detaches again without affecting the other processes.
+ *
+ * @param name the shared memory object holding the buffer
+ *
+ * @return The buffer, or NULL with errno set to EAGAIN if its creator has
+ *         not finished setting it up, EINVAL if `name` does not hold a
+ *         buffer of this version of the library, or as set by shm_open().
+ */
+CBAPI struct circular_buffer * CBCALL cb_open_shm(const char *name)
+{
+#ifdef __linux__
+	struct circular_buffer *buffer;
+	size_t header = shm_header_size();
+	struct stat st;
+	int fd, error = EINVAL;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if ((size_t)st.st_size <= header ||
+			((size_t)st.st_size - header) % _cb_page_size()) {
+		close(fd);
+		errno = st.st_size == 0 ? EAGAIN : EINVAL;
+		return NULL;
+	}
+
+	buffer = (struct circular_buffer *)map_mirrored(fd, header,
+		st.st_size - header);
+	close(fd);
+	if (!buffer)
+		return NULL;
+
+	if (load_acquire(&buffer->magic) != CB_SHM_MAGIC) {
+		if (buffer->magic == 0)
+			error = EAGAIN;
+		goto fail;
+	}
+	if (buffer->data_offset != header ||
+			header + _storage(buffer) != (size_t)st.st_size)
+		goto fail;
+
+	return buffer;
+fail:
+	munmap(buffer, st.st_size + (st.st_size - header));
+	errno = error;
+	return NULL;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+/**
+ * Removes the name of a shared memory buffer. Processes attached to it keep
+ * using it until they call cb_destroy.
+ *
+ * @return Zero, or -1 with errno set by shm_unlink().
+ */
+CBAPI int CBCALL cb_unlink_shm(const char *name)
+{
+#ifdef __linux__
+	return shm_unlink(name);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+CBAPI size_t CBCALL cb_available_data64(struct circular_buffer *buffer)
+{
+	size_t available = 0;
+
+	lock(buffer);
+
+	available = _available_data(buffer);
+
+	unlock(buffer);
+
+	assert(available <= buffer->length);
+
+	return available;
+}
+
+CBAPI size_t CBCALL cb_available_space64(struct circular_buffer *buffer)
+{
+	size_t available = 0;
+
+	lock(buffer);
+
+	available = _available_space(buffer);
+
+	unlock(buffer);
+
+	assert(available <= buffer->length);
+
+	return available;
+}
+
+CBAPI int CBCALL cb_available_data(struct circular_buffer *buffer)
+{
+	size_t available = cb_available_data64(buffer);
+	return available > INT_MAX ? INT_MAX : (int)available;
+}
+
+CBAPI int CBCALL cb_available_space(struct circular_buffer *buffer)
+{
+	size_t available = cb_available_space64(buffer);
+	return available > INT_MAX ? INT_MAX : (int)available;
+}
+
+/*
+ * Reads up to `max` bytes, but only if at least `min` are available, so a
+ * reader never takes less than it asked for.
+ */
+static size_t _read(struct circular_buffer *buffer, char *target, size_t min, size_t max)
+{
+	size_t available, tail, amount = max;
+
+	if (amount < 1)
+		return 0;
+
+	lock(buffer);
+
+	tail = buffer->tail;
+	available = _consumer_data(buffer, tail, max);
+
+	if (available < min) {
+		if (probe_enabled(read_empty))
+			probe3(read_empty, buffer, min, available);
+		amount = 0;
+		goto out;
+	}
+
+	if (amount > available) {
+		amount = available;
+	}
+
+	_copy_out(buffer, tail, target, amount);
+
+	tail = _advance(buffer, tail, amount);
+	publish_tail(buffer, tail);
+
+out:
+	if (stats(buffer) && amount < max)
+		count(buffer, &buffer->stat_reads_short, 1);
+	unlock(buffer);
+
+	return amount;
+}
+
+/**
+ * Attempts to read up to `amount` bytes from `buffer` into the buffer
+ * starting at `target`.
+ *
+ * If `amount` is zero or less, zero is returned.
+ *
+ * @param buffer the buffer to read from
+ * @param target location to copy data to
+ * @param amount the number of bytes to attempt to copy
+ *
+ * @return A maximum of `amount` of bytes read into `target`.
+ */
+CBAPI ssize_t CBCALL cb_read64(struct circular_buffer *buffer, char *target, size_t amount)
+{
+	return _read(buffer, target, 1, amount);
+}
+
+CBAPI int CBCALL cb_read(struct circular_buffer *buffer, char *target, int amount)
+{
+	if (amount < 1)
+		return 0;
+	return (int)_read(buffer, target, 1, amount);
+}
+
+
+/**
+ * Exposes the readable data of `buffer` without copying it.
+ *
+ * The data starts at `*seg1` for `*len1` bytes and, if it wraps, continues
+ * at `*seg2` for `*len2` bytes. Pass NULL for `seg2` and `len2` to only get
+ * the contiguous span. The data stays in the buffer until it is released
+ * with cb_read_consume.
+ *
+ * @param buffer the buffer to read from
+ * @param seg1 set to the start of the first readable span
+ * @param len1 set to the length of the first readable span
+ * @param seg2 set to the start of the second readable span, may be NULL
+ * @param len2 set to the length of the second readable span, may be NULL
+ *
+ * @return The number of readable bytes described by the spans.
+ */
+CBAPI size_t CBCALL cb_read_peek(struct circular_buffer *buffer,
+		char **seg1, size_t *len1, char **seg2, size_t *len2)
+{
+	size_t available, first, tail;
+
+	lock(buffer);
+
+	tail = buffer->tail;
+	available = _consumer_data(buffer, tail, buffer->length);
+	first = _contiguous(buffer, tail, available);
+
+	unlock(buffer);
+
+	*seg1 = _data(buffer) + _index(buffer, tail);
+	*len1 = first;
+	if (seg2 && len2) {
+		*seg2 = _data(buffer);
+		*len2 = available - first;
+		return available;
+	}
+
+	return first;
+}
+
+/**
+ * Releases `amount` bytes previously examined through cb_read_peek.
+ *
+ * @param buffer the buffer to read from
+ * @param amount the number of bytes to drop
+ *
+ * @return `amount`, or -1 if `amount` exceeds the available data.
+ */
+CBAPI ssize_t CBCALL cb_read_consume(struct circular_buffer *buffer, size_t amount)
+{
+	size_t available, tail;
+	ssize_t ret = amount;
+
+	if (amount < 1)
+		return 0;
+
+	lock(buffer);
+
+	tail = buffer->tail;
+	available = _consumer_data(buffer, tail, amount);
+
+	if (amount > available) {
+		ret = -1;
+		goto out;
+	}
+
+	tail = _advance(buffer, tail, amount);
+	publish_tail(buffer, tail);
+
+out:
+	unlock(buffer);
+
+	return ret;
+}
+
+CBAPI int CBCALL cb_read_single(struct circular_buffer *buffer, char *target)
+{
+	return cb_read(buffer, target, 1);
+}
+
+/*
+ * CB_MPSC writes claim the range [start, start + amount) by moving the
+ * reservation counter past it. The bytes become readable when every earlier
+ * claim has been published and head reaches `start`. Returns the claimed
+ * amount, between `min` and `max`, or zero if fewer than `min` bytes fit.
+ */
+static size_t _claim_mpsc(struct circular_buffer *buffer, size_t min,
+		size_t max, size_t *start)
+{
+	size_t tail, space, amount;
+
+	*start = load_relaxed(&buffer->reserve);
+	do {
+		tail = load_acquire(&buffer->tail);
+		space = buffer->length - (*start - tail);
+		if (space < min) {
+			reject_write(buffer, min, space);
+			return 0;
+		}
+		amount = max < space ? max : space;
+	} while (!compare_exchange(&buffer->reserve, start, *start + amount));
+
+	return amount;
+}
+
+/*
+ * Ordered publish: head only ever covers fully copied claims, so the
+ * consumer needs no commit flags, at the price of each writer waiting for
+ * the writers that claimed before it.
+ */
+static void _publish_mpsc(struct circular_buffer *buffer, size_t start,
+		size_t amount)
+{
+	while (load_acquire(&buffer->head) != start)
+		yield_cpu();
+	publish_head(buffer, start + amount);
+}
+
+static size_t _write_mpsc(struct circular_buffer *buffer, char *data,
+		size_t min, size_t max)
+{
+	size_t start, amount = _claim_mpsc(buffer, min, max, &start);
+
+	if (amount > 0) {
+		_copy_in(buffer, start, data, amount);
+		_publish_mpsc(buffer, start, amount);
+	}
+
+	return amount;
+}
+
+/*
+ * CB_OVERWRITE: drops the oldest data so that `amount` bytes fit, keeping
+ * only the tail end of writes larger than the buffer. Called with the lock
+ * held. Returns how much of `data` is left to write.
+ */
+static size_t _make_room(struct circular_buffer *buffer, char **data,
+		size_t amount, size_t available)
+{
+	size_t tail, drop;
+
+	if (amount > buffer->length) {
+		buffer->dropped += amount - buffer->length;
+		*data += amount - buffer->length;
+		amount = buffer->length;
+	}
+	if (amount <= available)
+		return amount;
+
+	drop = amount - available;
+	buffer->dropped += drop;
+	tail = _advance(buffer, buffer->tail, drop);
+	/* The consumer's cached head may now be behind tail. */
+	buffer->cached_tail = tail;
+	buffer->cached_head = buffer->head;
+	if (buffer->residence)
+		stamp_read(buffer, tail, 0);
+	move_tail(buffer, tail);
+
+	return amount;
+}
+
+/*
+ * Writes up to `max` bytes, but only if at least `min` fit, the counterpart
+ * of _read(). Returns how many bytes of `data` were accepted.
+ */
+static size_t _write(struct circular_buffer *buffer, char *data, size_t min, size_t max)
+{
+	size_t available, head, amount = max, accepted = max;
+
+	if (amount < 1)
+		return 0;
+	if (mpsc(buffer))
+		return _write_mpsc(buffer, data, min, max);
+
+	lock(buffer);
+
+	head = buffer->head;
+	available = _producer_space(buffer, head, max);
+
+	/* All of `data` counts as accepted, even a part that is dropped. */
+	if (amount > available && overwrite(buffer)) {
+		amount = _make_room(buffer, &data, amount, available);
+		available = min = amount;
+	}
+
+	if (available < min) {
+		reject_write(buffer, min, available);
+		accepted = 0;
+		goto out;
+	}
+
+	if (amount > available) {
+		amount = accepted = available;
+	}
+
+	_copy_in(buffer, head, data, amount);
+
+	head = _advance(buffer, head, amount);
+	publish_head(buffer, head);
+
+out:
+	unlock(buffer);
+
+	return accepted;
+}
+
+/**
+ * Writes all `amount` bytes of `data` to `buffer`, or nothing at all if
+ * they do not fit.
+ *
+ * @param buffer the buffer to write to
+ * @param data the bytes to write
+ * @param amount the number of bytes to write
+ *
+ * @return `amount`, or -1 if there is not enough space.
+ */
+CBAPI ssize_t CBCALL cb_write64(struct circular_buffer *buffer, char *data, size_t amount)
+{
+	if (amount < 1)
+		return 0;
+	if (_write(buffer, data, amount, amount) == 0)
+		return -1;
+	return amount;
+}
+
+CBAPI int CBCALL cb_write(struct circular_buffer *buffer, char *data, int amount)
+{
+	if (amount < 1)
+		return 0;
+	return (int)cb_write64(buffer, data, amount);
+}
+
+/**
+ * Writes as much of `data` as fits into `buffer`, the way cb_read returns
+ * less than asked for when less is available. Streaming producers can fill
+ * the buffer with one call per chunk instead of checking the free space
+ * first.
+ *
+ * @param buffer the buffer to write to
+ * @param data the bytes to write
+ * @param amount the number of bytes to attempt to write
+ *
+ * @return The number of bytes of `data` written, zero if the buffer is full.
+ */
+CBAPI ssize_t CBCALL cb_write_some64(struct circular_buffer *buffer, char *data, size_t amount)
+{
+	return _write(buffer, data, 1, amount);
+}
+
+CBAPI int CBCALL cb_write_some(struct circular_buffer *buffer, char *data, int amount)
+{
+	if (amount < 1)
+		return 0;
+	return (int)_write(buffer, data, 1, amount);
+}
+
+/*
+ * Parks the caller until `ready(buffer)` reports at least `amount` bytes.
+ * With CB_STATS the time spent is added to `waited`.
+ *
+ * @return 0 once ready, or -1 with errno set to ETIMEDOUT.
+ */
+static int park(struct circular_buffer *buffer,
+		size_t (*ready)(struct circular_buffer *), size_t amount,
+		int *waiters, unsigned int *seq, long long deadline,
+		unsigned long long *waited)
+{
+	unsigned int observed;
+	long long remaining = -1, start = stats(buffer) ? now_ns() : 0;
+	int ret = 0;
+
+	fetch_add(waiters, 1);
+	for (;;) {
+		observed = load_acquire(seq);
+		if (ready(buffer) >= amount)
+			break;
+		if (deadline >= 0) {
+			remaining = deadline - now_ns();
+			if (remaining <= 0) {
+				errno = ETIMEDOUT;
+				ret = -1;
+				break;
+			}
+		}
+		futex_wait(buffer, seq, observed, remaining);
+	}
+	fetch_add(waiters, -1);
+	if (stats(buffer))
+		fetch_add(waited, now_ns() - start);
+
+	return ret;
+}
+
+/**
+ * Reads at least `min` and up to `max` bytes from `buffer`, waiting for the
+ * data to arrive if needed.
+ *
+ * The calling thread sleeps until a writer publishes new data; it does not
+ * spin. A negative `timeout_ns` waits forever, zero does not wait at all.
+ *
+ * @param buffer the buffer to read from
+ * @param target location to copy data to
+ * @param min the minimum number of bytes to read
+ * @param max the maximum number of bytes to read
+ * @param timeout_ns how long to wait in nanoseconds
+ *
+ * @return The number of bytes read, or -1 with errno set to ETIMEDOUT or
+ *         EINVAL if `min` can never be satisfied.
+ */
+CBAPI int CBCALL cb_read_wait(struct circular_buffer *buffer, char *target,
+		int min, int max, long long timeout_ns)
+{
+	long long deadline = timeout_ns < 0 ? -1 : now_ns() + timeout_ns;
+	int ret;
+
+	if (min < 1)
+		min = 1;
+	if (min > max || (size_t)min > buffer->length) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while ((ret = (int)_read(buffer, target, min, max)) == 0) {
+		if (park(buffer, _available_data, min, &buffer->read_waiters,
+				&buffer->read_seq, deadline,
+				&buffer->stat_read_wait_ns) < 0)
+			return -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Writes all `amount` bytes of `data` to `buffer`, waiting for enough space
+ * to become free if needed.
+ *
+ * A negative `timeout_ns` waits forever, zero does not wait at all.
+ *
+ * @param buffer the buffer to write to
+ * @param data the bytes to write
+ * @param amount the number of bytes to write
+ * @param timeout_ns how long to wait in nanoseconds
+ *
+ * @return `amount`, or -1 with errno set to ETIMEDOUT or EINVAL if `amount`
+ *         can never fit.
+ */
+CBAPI int CBCALL cb_write_wait(struct circular_buffer *buffer, char *data,
+		int amount, long long timeout_ns)
+{
+	long long deadline = timeout_ns < 0 ? -1 : now_ns() + timeout_ns;
+	int ret;
+
+	if (amount > 0 && (size_t)amount > buffer->length) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while ((ret = cb_write(buffer, data, amount)) < 0) {
+		if (park(buffer, _available_space, amount, &buffer->write_waiters,
+				&buffer->write_seq, deadline,
+				&buffer->stat_write_wait_ns) < 0)
+			return -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Exposes the free space of `buffer` so the producer can fill it in place.
+ *
+ * The free space starts at `*seg1` for `*len1` bytes and, if it wraps,
+ * continues at `*seg2` for `*len2` bytes. Pass NULL for `seg2` and `len2` to
+ * only ask for the contiguous span. Nothing becomes readable until the bytes
+ * are published with cb_write_commit. Only one reservation may be
+ * outstanding at a time.
+ *
+ * @param buffer the buffer to write to
+ * @param min the minimum number of bytes the caller needs
+ * @param seg1 set to the start of the first writable span
+ * @param len1 set to the length of the first writable span
+ * @param seg2 set to the start of the second writable span, may be NULL
+ * @param len2 set to the length of the second writable span, may be NULL
+ *
+ * @return The number of writable bytes, or -1 if fewer than `min` are free.
+ */
+CBAPI ssize_t CBCALL cb_write_reserve(struct circular_buffer *buffer, size_t min,
+		char **seg1, size_t *len1, char **seg2, size_t *len2)
+{
+	size_t available, first, head;
+
+	if (mpsc(buffer)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	lock(buffer);
+
+	head = buffer->head;
+	available = _producer_space(buffer, head, buffer->length);
+	first = _contiguous(buffer, head, available);
+
+	unlock(buffer);
+
+	if (!seg2 || !len2)
+		available = first;
+	if (available < min)
+		return -1;
+
+	*seg1 = _data(buffer) + _index(buffer, head);
+	*len1 = first;
+	if (seg2 && len2) {
+		*seg2 = _data(buffer);
+		*len2 = available - first;
+	}
+
+	return available;
+}
+
+/**
+ * Publishes `amount` bytes previously filled in through cb_write_reserve.
+ *
+ * @param buffer the buffer to write to
+ * @param amount the number of bytes to make readable
+ *
+ * @return `amount`, or -1 if `amount` exceeds the free space.
+ */
+CBAPI ssize_t CBCALL cb_write_commit(struct circular_buffer *buffer, size_t amount)
+{
+	size_t available, head;
+	ssize_t ret = amount;
+
+	if (amount < 1)
+		return 0;
+	if (mpsc(buffer)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	lock(buffer);
+
+	head = buffer->head;
+	available = _producer_space(buffer, head, amount);
+
+	if (amount > available) {
+		ret = -1;
+		goto out;
+	}
+
+	head = _advance(buffer, head, amount);
+	publish_head(buffer, head);
+
+out:
+	unlock(buffer);
+
+	return ret;
+}
+
+/**
+ * Reads up to `max` bytes from the descriptor `fd` straight into the free
+ * space of `buffer`, with a single readv() covering both sides of the wrap.
+ *
+ * The mutex is held across the system call, so `fd` should be non-blocking
+ * when other threads use the buffer. Not available in CB_MPSC mode.
+ *
+ * @param buffer the buffer to write to
+ * @param fd the descriptor to read from
+ * @param max the maximum number of bytes to transfer
+ *
+ * @return The number of bytes transferred, zero at end of file, or -1 with
+ *         errno set by readv(), or to ENOBUFS if the buffer is full.
+ */
+CBAPI ssize_t CBCALL cb_write_from_fd(struct circular_buffer *buffer, int fd,
+		size_t max)
+{
+#ifdef WIN32
+	errno = ENOSYS;
+	return -1;
+#else
+	struct iovec iov[2];
+	size_t available, first, head;
+	ssize_t ret;
+
+	if (max < 1)
+		return 0;
+	if (mpsc(buffer)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	lock(buffer);
+
+	head = buffer->head;
+	available = _producer_space(buffer, head, max);
+	if (available > max)
+		available = max;
+
+	if (available == 0) {
+		errno = ENOBUFS;
+		ret = -1;
+		goto out;
+	}
+
+	first = _contiguous(buffer, head, available);
+	iov[0].iov_base = _data(buffer) + _index(buffer, head);
+	iov[0].iov_len = first;
+	iov[1].iov_base = _data(buffer);
+	iov[1].iov_len = available - first;
+
+	ret = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+	if (ret > 0)
+		publish_head(buffer, _advance(buffer, head, ret));
+
+out:
+	unlock(buffer);
+
+	return ret;
+#endif
+}
+
+/**
+ * Writes up to `max` bytes of the data in `buffer` to the descriptor `fd`
+ * with a single writev() covering both sides of the wrap. Only the bytes
+ * the kernel accepted are removed from the buffer.
+ *
+ * The mutex is held across the system call, so `fd` should be non-blocking
+ * when other threads use the buffer.
+ *
+ * @param buffer the buffer to read from
+ * @param fd the descriptor to write to
+ * @param max the maximum number of bytes to transfer
+ *
+ * @return The number of bytes transferred, zero if the buffer is empty, or
+ *         -1 with errno set by writev().
+ */
+CBAPI ssize_t CBCALL cb_read_to_fd(struct circular_buffer *buffer, int fd,
+		size_t max)
+{
+#ifdef WIN32
+	errno = ENOSYS;
+	return -1;
+#else
+	struct iovec iov[2];
+	size_t available, first, tail;
+	ssize_t ret = 0;
+
+	if (max < 1)
+		return 0;
+
+	lock(buffer);
+
+	tail = buffer->tail;
+	available = _consumer_data(buffer, tail, max);
+	if (available > max)
+		available = max;
+
+	if (available == 0)
+		goto out;
+
+	first = _contiguous(buffer, tail, available);
+	iov[0].iov_base = _data(buffer) + _index(buffer, tail);
+	iov[0].iov_len = first;
+	iov[1].iov_base = _data(buffer);
+	iov[1].iov_len = available - first;
+
+	ret = writev(fd, iov, iov[1].iov_len ? 2 : 1);
+	if (ret > 0)
+		publish_tail(buffer, _advance(buffer, tail, ret));
+
+out:
+	unlock(buffer);
+
+	return ret;
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Swaps the pages holding [pos, pos + amount) for fresh ones, keeping their
+ * contents. The old pages stay with whoever still references them, like a
+ * pipe or a socket they were vmspliced into, so the producer can reuse the
+ * range without changing the bytes in flight. Whole pages just get zero
+ * pages mapped over them; only a trailing partial page is copied.
+ */
+static int _renew_pages(struct circular_buffer *buffer, size_t pos,
+		size_t amount)
+{
+	size_t page = _cb_page_size(), first, whole;
+	char *addr, *copy;
+
+	while (amount > 0) {
+		first = _contiguous(buffer, pos, amount);
+		addr = _data(buffer) + _index(buffer, pos);
+		whole = first / page * page;
+
+		if (whole > 0 && mmap(addr, whole, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+				-1, 0) == MAP_FAILED)
+			return -1;
+		if (first > whole) {
+			copy = mmap(NULL, page, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (copy == MAP_FAILED)
+				return -1;
+			memcpy(copy, addr + whole, page);
+			if (mremap(copy, page, page, MREMAP_MAYMOVE | MREMAP_FIXED,
+					addr + whole) == MAP_FAILED) {
+				munmap(copy, page);
+				return -1;
+			}
+		}
+
+		pos = _advance(buffer, pos, first);
+		amount -= first;
+	}
+
+	return 0;
+}
+#endif
+
+/**
+ * Sends up to `max` bytes of the data in `buffer` to the descriptor `fd`,
+ * typically a socket, without copying them in user space where possible.
+ *
+ * With CB_PAGE_ALIGNED (and not CB_MIRRORED) whole pages of data are
+ * gifted: they are vmspliced into an internal pipe, swapped for fresh
+ * pages in the buffer, and spliced on to `fd`. Bytes in the internal pipe
+ * no longer count as data of the buffer; when `fd` cannot take them all,
+ * they go out first on the next call. Since the buffer never touches a
+ * gifted page again, the destination may hold on to it, as a TCP socket
+ * does until the data is acknowledged. Partial pages, and all data of
+ * other buffers, are written with writev() like cb_read_to_fd.
+ *
+ * Do not mix this with other reads while bytes wait in the internal pipe;
+ * they would overtake them. cb_clear discards them. Not available for
+ * buffers in shared memory.
+ *
+ * @param buffer the buffer to read from
+ * @param fd the descriptor to send to
+ * @param max the maximum number of bytes to send
+ *
+ * @return The number of bytes sent, zero if the buffer and the internal
+ *         pipe are empty, or -1 with errno set by vmsplice(), splice() or
+ *         writev(), e.g. to EAGAIN if `fd` is full.
+ */
+CBAPI ssize_t CBCALL cb_splice_out(struct circular_buffer *buffer, int fd,
+		size_t max)
+{
+#ifdef __linux__
+	struct iovec iov[2];
+	size_t available, first, tail, page = _cb_page_size();
+	ssize_t ret = 0, queued;
+	int gift = (buffer->flags & CB_PAGE_ALIGNED) && !mirrored(buffer);
+
+	if (max < 1)
+		return 0;
+	if (shared(buffer)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	lock(buffer);
+
+	if (buffer->splice_fds[0] < 0 &&
+			pipe2(buffer->splice_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+		buffer->splice_fds[0] = buffer->splice_fds[1] = -1;
+		ret = -1;
+		goto out;
+	}
+
+	/* Bytes already taken from the buffer go first. */
+	if (buffer->splice_pending > 0) {
+		ret = splice(buffer->splice_fds[0], NULL, fd, NULL,
+			buffer->splice_pending < max ? buffer->splice_pending : max,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret > 0)
+			buffer->splice_pending -= ret;
+		goto out;
+	}
+
+	tail = buffer->tail;
+	available = _consumer_data(buffer, tail, buffer->length);
+	if (available > max)
+		available = max;
+	if (available == 0)
+		goto out;
+
+	first = _contiguous(buffer, tail, available);
+	iov[0].iov_base = _data(buffer) + _index(buffer, tail);
+	iov[0].iov_len = first;
+	iov[1].iov_base = _data(buffer);
+	iov[1].iov_len = available - first;
+
+	if (!gift || _index(buffer, tail) % page != 0 || available < page) {
+		/* Stop at the page boundary so the next call can gift. */
+		if (gift && iov[0].iov_len > page - _index(buffer, tail) % page) {
+			iov[0].iov_len = page - _index(buffer, tail) % page;
+			iov[1].iov_len = 0;
+		}
+		ret = writev(fd, iov, iov[1].iov_len ? 2 : 1);
+		if (ret > 0)
+			publish_tail(buffer, _advance(buffer, tail, ret));
+		goto out;
+	}
+
+	/* The storage is whole pages, so pages never straddle the wrap. */
+	available = available / page * page;
+	if (first > available)
+		iov[0].iov_len = available;
+	iov[1].iov_len = available - iov[0].iov_len;
+
+	queued = vmsplice(buffer->splice_fds[1], iov, iov[1].iov_len ? 2 : 1,
+		SPLICE_F_GIFT | SPLICE_F_NONBLOCK);
+	if (queued < 0) {
+		ret = -1;
+		goto out;
+	}
+	if (_renew_pages(buffer, tail, queued) < 0) {
+		/* The pipe held nothing else, so the data is still all here. */
+		close_splice_pipe(buffer);
+		ret = -1;
+		goto out;
+	}
+	buffer->splice_pending = queued;
+	publish_tail(buffer, _advance(buffer, tail, queued));
+
+	ret = splice(buffer->splice_fds[0], NULL, fd, NULL, queued,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (ret > 0)
+		buffer->splice_pending -= ret;
 
-#include "circular_buffer.h"
+out:
+	unlock(buffer);
 
-#ifdef DEBUG
-#define debug(M, ...) fprintf(stderr, "DEBUG %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
+	return ret;
 #else
-#define debug(M, ...)
-#endif
-
-static void lock(struct circular_buffer *buffer)
-{
-#ifdef WIN32
-	WaitForSingleObject(buffer->mutex, INFINITE);
-#else /* Unix */
-	pthread_mutex_lock(&buffer->mutex);
+	errno = ENOSYS;
+	return -1;
 #endif
 }
 
-static void unlock(struct circular_buffer *buffer)
+/*
+ * Records are stored as a LEB128 varint holding the payload length followed
+ * by the payload. Every record is published with a single head update, so
+ * the consumer never sees part of one.
+ */
+#define MSG_HEADER_MAX 10 /* enough for a 64-bit length */
+
+static size_t _msg_encode(unsigned char *header, size_t length)
 {
-#ifdef WIN32
-	ReleaseMutex(buffer->mutex);
-#else /* Unix */
-	pthread_mutex_unlock(&buffer->mutex);
-#endif
+	size_t n = 0;
+
+	do {
+		header[n] = length & 0x7f;
+		length >>= 7;
+		if (length)
+			header[n] |= 0x80;
+		n++;
+	} while (length);
+
+	return n;
 }
 
-CBAPI struct circular_buffer * CBCALL cb_create(int length)
+/*
+ * Decodes the header of the record at `tail`, given `available` readable
+ * bytes. Returns the header size and sets `*length`, or returns zero if
+ * there is no complete record.
+ */
+static size_t _msg_decode(struct circular_buffer *buffer, size_t tail,
+		size_t available, size_t *length)
 {
-	struct circular_buffer *buffer = calloc(1, sizeof(struct circular_buffer));
-	if (!buffer)
-		return NULL;
+	size_t n = 0, shift = 0, byte;
 
-	buffer->length = length;
-	buffer->tail = 0;
-	buffer->head = 0;
-	buffer->buffer = calloc(buffer->length + 1, sizeof(char));
-	if (!buffer->buffer) goto fail;
+	*length = 0;
+	do {
+		if (n == available || n == MSG_HEADER_MAX)
+			return 0;
+		byte = (unsigned char)_data(buffer)[_index(buffer,
+			_advance(buffer, tail, n))];
+		*length |= (byte & 0x7f) << shift;
+		shift += 7;
+		n++;
+	} while (byte & 0x80);
 
-#ifdef WIN32
-	buffer->mutex = CreateMutex(
-		NULL,   /* default security attributes */
-		FALSE,  /* initially not owned */
-		NULL);  /* unnamed mutex */
-#else /* Unix */
-	pthread_mutexattr_t attr;
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
-	pthread_mutex_init(&buffer->mutex, &attr);
-#endif
+	if (available - n < *length)
+		return 0;
 
-	return buffer;
-fail_mutex:
-	free(buffer->buffer);
-fail:
-	free(buffer);
-	return NULL;
+	return n;
 }
 
-CBAPI void CBCALL cb_destroy(struct circular_buffer *buffer)
+/*
+ * CB_OVERWRITE for records: drops whole records from the front until `want`
+ * bytes are free, so tail always stays on a record boundary. Called with the
+ * lock held. Returns the free space.
+ */
+static size_t _msg_make_room(struct circular_buffer *buffer, size_t want,
+		size_t available)
 {
-	/* Make sure no other threads are using the buffer before destroying it. */
-#ifdef WIN32
-	CloseHandle(buffer->mutex);
-#else
-	pthread_mutex_destroy(&buffer->mutex);
-#endif
-	free(buffer->buffer);
-	free(buffer);
+	size_t header, length, tail = buffer->tail, head = buffer->head;
+
+	while (available < want) {
+		header = _msg_decode(buffer, tail, _distance(buffer, tail, head),
+			&length);
+		if (!header)
+			break;
+		tail = _advance(buffer, tail, header + length);
+		available += header + length;
+		buffer->dropped += header + length;
+	}
+
+	buffer->cached_tail = tail;
+	buffer->cached_head = head;
+	if (buffer->residence)
+		stamp_read(buffer, tail, 0);
+	move_tail(buffer, tail);
+
+	return available;
 }
 
-static int _available_data(struct circular_buffer *buffer)
+/**
+ * Writes `length` bytes of `data` as one record, preceded by a varint
+ * header with its length. The record is written whole or not at all.
+ *
+ * In CB_OVERWRITE mode the oldest records are dropped to make room. Do not
+ * mix records with plain cb_write data in the same buffer.
+ *
+ * @param buffer the buffer to write to
+ * @param data the payload of the record
+ * @param length the size of the payload, may be zero
+ *
+ * @return `length`, or -1 if there is not enough space. errno is set to
+ *         EMSGSIZE if the record can never fit.
+ */
+CBAPI ssize_t CBCALL cb_msg_write(struct circular_buffer *buffer, char *data,
+		size_t length)
 {
-	int available = 0;
+	unsigned char header[MSG_HEADER_MAX];
+	size_t available, head, size = _msg_encode(header, length);
+	ssize_t ret = length;
 
-	if (buffer->head == buffer->tail)
-		available = 0;
-	else if (buffer->tail < buffer->head)
-		available = buffer->head - buffer->tail;
-	else
-		available = (buffer->length + 1) - buffer->tail + buffer->head;
+	if (length > buffer->length || size + length > buffer->length) {
+		errno = EMSGSIZE;
+		return -1;
+	}
 
-	return available;
+	if (mpsc(buffer)) {
+		if (!_claim_mpsc(buffer, size + length, size + length, &head))
+			return -1;
+		_copy_in(buffer, head, (char *)header, size);
+		_copy_in(buffer, head + size, data, length);
+		_publish_mpsc(buffer, head, size + length);
+		return ret;
+	}
+
+	lock(buffer);
+
+	head = buffer->head;
+	available = _producer_space(buffer, head, size + length);
+
+	if (available < size + length && overwrite(buffer))
+		available = _msg_make_room(buffer, size + length, available);
+
+	if (available < size + length) {
+		reject_write(buffer, size + length, available);
+		ret = -1;
+		goto out;
+	}
+
+	_copy_in(buffer, head, (char *)header, size);
+	_copy_in(buffer, _advance(buffer, head, size), data, length);
+	publish_head(buffer, _advance(buffer, head, size + length));
+
+out:
+	unlock(buffer);
+
+	return ret;
 }
 
-static int _available_space(struct circular_buffer *buffer)
+/**
+ * Copies the oldest record into `target` and removes it from `buffer`.
+ *
+ * @param buffer the buffer to read from
+ * @param target location to copy the payload to
+ * @param size the number of bytes `target` can hold
+ *
+ * @return The payload length, or -1 with errno set to EAGAIN if there is no
+ *         record, or EMSGSIZE if it is larger than `size`. In the latter
+ *         case the record stays in the buffer.
+ */
+CBAPI ssize_t CBCALL cb_msg_read(struct circular_buffer *buffer, char *target,
+		size_t size)
 {
-	return buffer->length - _available_data(buffer);
+	size_t available, header, length, tail;
+	ssize_t ret;
+
+	lock(buffer);
+
+	tail = buffer->tail;
+	/* Head only moves by whole records, so any data holds one. */
+	available = _consumer_data(buffer, tail, 1);
+	header = _msg_decode(buffer, tail, available, &length);
+
+	if (!header) {
+		errno = EAGAIN;
+		ret = -1;
+		goto out;
+	}
+	if (length > size) {
+		errno = EMSGSIZE;
+		ret = -1;
+		goto out;
+	}
+
+	tail = _advance(buffer, tail, header);
+	_copy_out(buffer, tail, target, length);
+	publish_tail(buffer, _advance(buffer, tail, length));
+	ret = length;
+
+out:
+	unlock(buffer);
+
+	return ret;
 }
 
-CBAPI int CBCALL cb_available_data(struct circular_buffer *buffer)
+/**
+ * Copies as many of the oldest records as fit into `target`, back to back,
+ * storing the payload length of each in `lengths`. All of them are taken
+ * under a single lock and released with a single tail update.
+ *
+ * @param buffer the buffer to read from
+ * @param target location to copy the payloads to
+ * @param size the number of bytes `target` can hold
+ * @param lengths set to the payload length of each record read
+ * @param count the maximum number of records to read
+ *
+ * @return The number of records read, or -1 with errno set to EMSGSIZE if
+ *         the oldest record alone is larger than `size`.
+ */
+CBAPI ssize_t CBCALL cb_msg_read_batch(struct circular_buffer *buffer,
+		char *target, size_t size, size_t *lengths, size_t count)
 {
-	int available = 0;
+	size_t available, header, length, tail, used = 0, n = 0;
 
 	lock(buffer);
 
-	available = _available_data(buffer);
+	tail = buffer->tail;
+	available = _consumer_data(buffer, tail, buffer->length);
+
+	while (n < count) {
+		header = _msg_decode(buffer, tail, available, &length);
+		if (!header || length > size - used)
+			break;
+		_copy_out(buffer, _advance(buffer, tail, header), target + used,
+			length);
+		lengths[n++] = length;
+		used += length;
+		tail = _advance(buffer, tail, header + length);
+		available -= header + length;
+	}
+
+	if (n > 0)
+		publish_tail(buffer, tail);
 
 	unlock(buffer);
 
-	assert(available >= 0);
+	if (n == 0 && count > 0 && header && length > size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
 
-	return available;
+	return n;
 }
 
-CBAPI int CBCALL cb_available_space(struct circular_buffer *buffer)
+/**
+ * Exposes the payload of the oldest record without copying it. It starts at
+ * `*seg1` for `*len1` bytes and continues at `*seg2` for `*len2` bytes if it
+ * wraps. With CB_MIRRORED `*len2` is always zero. Pass NULL for `seg2`
+ * and `len2` to only get the contiguous span, in which case `*len1` falls
+ * short of the returned length when the record wraps. The record stays in
+ * the buffer until it is released with cb_msg_consume.
+ *
+ * @param buffer the buffer to read from
+ * @param seg1 set to the start of the payload
+ * @param len1 set to the length of the first span
+ * @param seg2 set to the start of the wrapped part of the payload, may be NULL
+ * @param len2 set to the length of the wrapped part of the payload, may be NULL
+ *
+ * @return The payload length, or -1 with errno set to EAGAIN if there is no
+ *         record.
+ */
+CBAPI ssize_t CBCALL cb_msg_peek(struct circular_buffer *buffer,
+		char **seg1, size_t *len1, char **seg2, size_t *len2)
 {
-	int available = 0;
+	size_t available, header, length, first, tail;
 
 	lock(buffer);
 
-	available = _available_space(buffer);
+	tail = buffer->tail;
+	available = _consumer_data(buffer, tail, 1);
+	header = _msg_decode(buffer, tail, available, &length);
 
 	unlock(buffer);
 
-	assert(available >= 0);
+	if (!header) {
+		errno = EAGAIN;
+		return -1;
+	}
 
-	return available;
+	tail = _advance(buffer, tail, header);
+	first = _contiguous(buffer, tail, length);
+	*seg1 = _data(buffer) + _index(buffer, tail);
+	*len1 = first;
+	if (seg2 && len2) {
+		*seg2 = _data(buffer);
+		*len2 = length - first;
+	}
+
+	return length;
 }
 
 /**
- * Attempts to read up to `amount` bytes from `buffer` into the buffer
- * starting at `target`.
- *
- * If `amount` is zero or less, zero is returned.
+ * Removes the oldest record, typically after looking at it with cb_msg_peek.
  *
  * @param buffer the buffer to read from
- * @param target location to copy data to
- * @param amount the number of bytes to attempt to copy
  *
- * @return A maximum of `amount` of bytes read into `target`.
+ * @return The payload length of the removed record, or -1 with errno set to
+ *         EAGAIN if there is no record.
  */
-CBAPI int CBCALL cb_read(struct circular_buffer *buffer, char *target, int amount)
+CBAPI ssize_t CBCALL cb_msg_consume(struct circular_buffer *buffer)
 {
-	int available, ret = 0;
-
-	if (amount < 1)
-		return 0;
+	size_t available, header, length, tail;
+	ssize_t ret = -1;
 
 	lock(buffer);
 
-	available = _available_data(buffer);
+	tail = buffer->tail;
+	available = _consumer_data(buffer, tail, 1);
+	header = _msg_decode(buffer, tail, available, &length);
 
-	if (amount > available) {
-		amount = available;
+	if (header) {
+		publish_tail(buffer, _advance(buffer, tail, header + length));
+		ret = length;
+	} else {
+		errno = EAGAIN;
 	}
 
-	if (buffer->tail <= buffer->head) {
-		memcpy(target, cb_starts_at(buffer), amount);
-	} else {
-		int tail_space = (buffer->length + 1) - buffer->tail;
-		assert(tail_space >= 0);
-		if (tail_space <= amount) {
-			memcpy(target, cb_starts_at(buffer), tail_space);
-			memcpy(target + tail_space, buffer->buffer, amount - tail_space);
-		} else {
-			memcpy(target, cb_starts_at(buffer), amount);
-		}
+	unlock(buffer);
+
+	return ret;
+}
+
+/*
+ * Creates the eventfd stored at `*fd` on first use. Racing callers agree on
+ * a single descriptor.
+ */
+static int get_event_fd(struct circular_buffer *buffer, int *fd)
+{
+#ifdef __linux__
+	int expected = -1, created = load_acquire(fd);
+
+	/* The descriptor would only be valid in one of the processes. */
+	if (shared(buffer)) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	buffer->tail = (buffer->tail + amount) % (buffer->length + 1);
-	assert(buffer->tail <= (buffer->length + 1));
-	assert(buffer->tail >= 0);
+	if (created >= 0)
+		return created;
 
-out:
-	unlock(buffer);
+	created = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (created < 0)
+		return -1;
+	if (!compare_exchange(fd, &expected, created)) {
+		close(created);
+		return expected;
+	}
 
-	return amount;
+	/* The buffer may already be past the threshold. */
+	update_events(buffer);
+
+	return created;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
 }
 
-CBAPI int CBCALL cb_read_single(struct circular_buffer *buffer, char *target)
+/**
+ * Returns an eventfd that is readable while at least the read threshold of
+ * bytes (one by default) is available, for use with poll/epoll.
+ *
+ * Notifications are coalesced: the descriptor is signalled once when the
+ * threshold is reached and drained by the library once the data drops below
+ * it again, so callers never read from it. It is closed by cb_destroy.
+ *
+ * @param buffer the buffer to watch
+ *
+ * @return The eventfd, or -1 on failure.
+ */
+CBAPI int CBCALL cb_get_read_fd(struct circular_buffer *buffer)
 {
-	return cb_read(buffer, target, 1);
+	return get_event_fd(buffer, &buffer->read_fd);
 }
 
-CBAPI int CBCALL cb_write(struct circular_buffer *buffer, char *data, int amount)
+/**
+ * Returns an eventfd that is readable while at least the write threshold of
+ * bytes (one by default) is free. See cb_get_read_fd.
+ *
+ * @param buffer the buffer to watch
+ *
+ * @return The eventfd, or -1 on failure.
+ */
+CBAPI int CBCALL cb_get_write_fd(struct circular_buffer *buffer)
 {
-	int available, ret = 0;
+	return get_event_fd(buffer, &buffer->write_fd);
+}
 
-	if (amount < 1)
-		return 0;
+/**
+ * Sets how many bytes must be available before the cb_get_read_fd
+ * descriptor becomes readable.
+ *
+ * @return Zero, or -1 if `threshold` is outside 1..length.
+ */
+CBAPI int CBCALL cb_set_read_threshold(struct circular_buffer *buffer, size_t threshold)
+{
+	if (threshold < 1 || threshold > buffer->length)
+		return -1;
+	store_release(&buffer->read_threshold, threshold);
+	update_events(buffer);
+	return 0;
+}
+
+/**
+ * Sets how many bytes must be free before the cb_get_write_fd descriptor
+ * becomes readable.
+ *
+ * @return Zero, or -1 if `threshold` is outside 1..length.
+ */
+CBAPI int CBCALL cb_set_write_threshold(struct circular_buffer *buffer, size_t threshold)
+{
+	if (threshold < 1 || threshold > buffer->length)
+		return -1;
+	store_release(&buffer->write_threshold, threshold);
+	update_events(buffer);
+	return 0;
+}
+
+/**
+ * Returns how many bytes CB_OVERWRITE writes have dropped so far, whether
+ * they were overwritten unread or never stored. A reader that sees this
+ * change between two reads knows it was lapped and lost data in between.
+ *
+ * @param buffer the buffer to query
+ *
+ * @return The total number of dropped bytes.
+ */
+CBAPI size_t CBCALL cb_dropped(struct circular_buffer *buffer)
+{
+	size_t dropped;
 
 	lock(buffer);
+	dropped = buffer->dropped;
+	unlock(buffer);
 
-	available = _available_space(buffer);
+	return dropped;
+}
 
-	if (amount > available) {
-		debug("Not enough space: %d request, %d available",
-			amount, available);
-		amount = -1;
-		goto out;
+/**
+ * Copies the counters of a CB_STATS buffer into `stats`.
+ *
+ * Each counter is read atomically but not all of them at the same instant,
+ * so a snapshot taken while other threads use the buffer may be slightly
+ * inconsistent, e.g. count a write whose bytes are not in yet. Rejected
+ * writes and short reads include every attempt of cb_write_wait and
+ * cb_read_wait. The byte counters include the headers of cb_msg_* records.
+ *
+ * @param buffer the buffer to query
+ * @param stats set to the counters
+ *
+ * @return 0, or -1 with errno set to EINVAL if the buffer was created
+ *         without CB_STATS.
+ */
+CBAPI int CBCALL cb_get_stats(struct circular_buffer *buffer, struct cb_stats *stats)
+{
+	if (!(buffer->flags & CB_STATS)) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	if (buffer->head >= buffer->tail) {
-		int head_space = (buffer->length + 1) - buffer->head;
-		assert(head_space >= 0);
-		if (head_space >= amount) {
-			memcpy(cb_ends_at(buffer), data, amount);
-		} else {
-			memcpy(cb_ends_at(buffer), data, head_space);
-			memcpy(buffer->buffer, data + head_space, amount - head_space);
-		}
+	stats->writes = load_relaxed(&buffer->stat_writes);
+	stats->bytes_written = load_relaxed(&buffer->stat_bytes_written);
+	stats->writes_rejected = load_relaxed(&buffer->stat_writes_rejected);
+	stats->reads = load_relaxed(&buffer->stat_reads);
+	stats->bytes_read = load_relaxed(&buffer->stat_bytes_read);
+	stats->reads_short = load_relaxed(&buffer->stat_reads_short);
+	stats->high_water = load_relaxed(&buffer->stat_high_water);
+	stats->lock_contended = load_relaxed(&buffer->stat_lock_contended);
+	stats->write_wait_ns = load_relaxed(&buffer->stat_write_wait_ns);
+	stats->read_wait_ns = load_relaxed(&buffer->stat_read_wait_ns);
+
+	return 0;
+}
+
+/**
+ * Copies the residence time histogram of a CB_LATENCY buffer into
+ * `latency`. Like cb_get_stats the snapshot is not atomic as a whole.
+ *
+ * @param buffer the buffer to query
+ * @param latency set to the histogram
+ *
+ * @return 0, or -1 with errno set to EINVAL if the buffer was created
+ *         without CB_LATENCY.
+ */
+CBAPI int CBCALL cb_get_latency(struct circular_buffer *buffer,
+		struct cb_latency *latency)
+{
+	struct cb_latency *histogram;
+	size_t i;
+
+	if (!buffer->residence) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	histogram = &buffer->residence->histogram;
+	latency->count = load_relaxed(&histogram->count);
+	latency->total_ns = load_relaxed(&histogram->total_ns);
+	latency->max_ns = load_relaxed(&histogram->max_ns);
+	for (i = 0; i < CB_LATENCY_BUCKETS; i++)
+		latency->buckets[i] = load_relaxed(&histogram->buckets[i]);
+
+	return 0;
+}
+
+/**
+ * Empties the residence time histogram of a CB_LATENCY buffer, e.g. after
+ * each scrape by a monitoring system. Reads completing meanwhile may be
+ * lost from the new histogram.
+ *
+ * @param buffer the buffer to reset
+ *
+ * @return 0, or -1 with errno set to EINVAL if the buffer was created
+ *         without CB_LATENCY.
+ */
+CBAPI int CBCALL cb_reset_latency(struct circular_buffer *buffer)
+{
+	struct cb_latency *histogram;
+	size_t i;
+
+	if (!buffer->residence) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	histogram = &buffer->residence->histogram;
+	store_relaxed(&histogram->count, 0);
+	store_relaxed(&histogram->total_ns, 0);
+	store_relaxed(&histogram->max_ns, 0);
+	for (i = 0; i < CB_LATENCY_BUCKETS; i++)
+		store_relaxed(&histogram->buckets[i], 0);
+
+	return 0;
+}
+
+/**
+ * Estimates a percentile of a histogram taken with cb_get_latency.
+ *
+ * @param latency the histogram
+ * @param percentile between 0 and 100
+ *
+ * @return The upper end of the bucket holding the percentile, capped at the
+ *         largest value recorded, or 0 for an empty histogram.
+ */
+CBAPI unsigned long long CBCALL cb_latency_percentile(
+		const struct cb_latency *latency, double percentile)
+{
+	unsigned long long sub = 1ULL << CB_LATENCY_SUB_BITS, upper;
+	double rank = percentile / 100 * latency->count;
+	size_t i, seen = 0;
+	int shift;
+
+	if (latency->count == 0)
+		return 0;
+
+	for (i = 0; i < CB_LATENCY_BUCKETS - 1; i++) {
+		seen += latency->buckets[i];
+		if (seen > 0 && seen >= rank)
+			break;
+	}
+	if (i < sub) {
+		upper = i;
 	} else {
-		memcpy(cb_ends_at(buffer), data, amount);
+		shift = (int)(i / sub) - 1;
+		upper = ((sub + i % sub + 1) << shift) - 1;
 	}
 
-	buffer->head = (buffer->head + amount) % (buffer->length + 1);
-	assert(buffer->head <= (buffer->length + 1));
-	assert(buffer->head >= 0);
+	return upper < latency->max_ns ? upper : latency->max_ns;
+}
 
-out:
-	unlock(buffer);
+/**
+ * Copies the mutex wait profile of `buffer` into `profile`.
+ *
+ * Profiles are only kept when the library is built with CB_LOCK_PROFILE,
+ * for buffers that use the mutex and live in private memory. Otherwise
+ * lock() stays the plain mutex call it always was.
+ *
+ * @param buffer the buffer to query
+ * @param profile set to the profile
+ *
+ * @return 0, or -1 with errno set to ENOSYS if profiling is not built in,
+ *         or EINVAL if `buffer` has no profile.
+ */
+CBAPI int CBCALL cb_get_lock_profile(struct circular_buffer *buffer,
+		struct cb_lock_profile *profile)
+{
+#ifdef CB_LOCK_PROFILE
+	int i;
 
-	return amount;
+	if (!buffer->lock_profile) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	profile->acquisitions = load_relaxed(&buffer->lock_profile->acquisitions);
+	profile->contended = load_relaxed(&buffer->lock_profile->contended);
+	profile->blocked_ns = load_relaxed(&buffer->lock_profile->blocked_ns);
+	for (i = 0; i < CB_LOCK_BUCKETS; i++)
+		profile->blocked[i] = load_relaxed(&buffer->lock_profile->blocked[i]);
+
+	return 0;
+#else
+	(void)buffer;
+	(void)profile;
+	errno = ENOSYS;
+	return -1;
+#endif
 }
 
 CBAPI void CBCALL cb_debug(struct circular_buffer *buf)
 {
-	int i;
+	size_t i;
 	lock(buf);
-	printf("{ length='%d' tail='%d' head='%d' available_data='%d' available_space='%d' buffer='",
+	printf("{ length='%zu' tail='%zu' head='%zu' available_data='%zu' available_space='%zu' buffer='",
 		buf->length, buf->tail, buf->head, _available_data(buf),
 		_available_space(buf));
-	for (i = 0; i < buf->length + 1; i++) {
+	for (i = 0; i < _storage(buf); i++) {
 		if (i != 0)
 			printf(" ");
-		if (i == buf->tail)
+		if (i == _index(buf, buf->tail))
 			printf("tail->");
-		if (i == buf->head)
+		if (i == _index(buf, buf->head))
 			printf("head->");
-		printf("%x", buf->buffer[i] & 0xff);
+		printf("%x", _data(buf)[i] & 0xff);
 	}
 	unlock(buf);
 	printf("' }\n");
@@ -246,8 +2603,24 @@ CBAPI void CBCALL cb_debug(struct circular_buffer *buf)
 
 CBAPI void CBCALL cb_clear(struct circular_buffer *buf)
 {
+	size_t head;
+
 	lock(buf);
-	buf->tail = 0;
-	buf->head = 0;
+	/*
+	 * Empty the buffer by moving tail up to head, like a read of all data,
+	 * rather than storing zero to both: in between the two stores a
+	 * lock-free reader or writer would see a bogus fill level.
+	 */
+	head = load_acquire(&buf->head);
+	if (probe_enabled(clear))
+		probe2(clear, buf, _distance(buf, buf->tail, head));
+	buf->cached_tail = head;
+	buf->cached_head = head;
+	buf->reserve = head;
+	/* Bytes queued for cb_splice_out are discarded along with the rest. */
+	close_splice_pipe(buf);
+	if (buf->residence)
+		stamp_read(buf, head, 0);
+	move_tail(buf, head);
 	unlock(buf);
 }
@@ -17,42 +17,249 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef WIN32
 #include <windows.h>
 #else /* UNIX */
 #include <pthread.h>
+#include <sys/types.h>
+#endif
+
+#ifdef _MSC_VER
+#include <BaseTsd.h>
+typedef SSIZE_T ssize_t;
+#endif
+
+/* Flags accepted by cb_create_flags(). */
+#define CB_SPSC 0x1 /* single producer/single consumer, no mutex on read/write */
+#define CB_MIRRORED 0x2 /* storage mapped twice back to back, Linux only */
+#define CB_POW2 0x4 /* power of two capacity, free-running head and tail */
+#define CB_MPSC 0x8 /* many producers, one consumer, no mutex; writes publish in claim order */
+#define CB_OVERWRITE 0x10 /* writes never fail, the oldest data is dropped */
+#define CB_PAGE_ALIGNED 0x20 /* storage is whole, page aligned pages */
+#define CB_SHM 0x40 /* set on buffers in shared memory, see cb_create_shm() */
+#define CB_STATS 0x80 /* keep the counters returned by cb_get_stats() */
+#define CB_LATENCY 0x100 /* time how long data waits to be read, see cb_get_latency() */
+
+/*
+ * Fields written by the producer, fields written by the consumer and the
+ * rarely written wake-up state each get their own cache line, so the two
+ * sides do not invalidate each other's line on every operation.
+ */
+#define CB_CACHELINE_SIZE 64
+#ifdef _MSC_VER
+#define CB_CACHELINE __declspec(align(CB_CACHELINE_SIZE))
+#else
+#define CB_CACHELINE __attribute__((aligned(CB_CACHELINE_SIZE)))
 #endif
 
+/*
+ * The layout is internal; only cb_starts_at/cb_ends_at and existing callers
+ * peeking at `buffer`, `length`, `head` and `tail` rely on it.
+ */
 struct circular_buffer {
-	char *buffer;
-	int length;
-	int tail;
-	int head;
+	/* Read-only after creation. */
+	char *buffer; /* NULL in shared memory, where only data_offset works */
+	size_t data_offset; /* storage address minus the struct address */
+	unsigned int magic; /* identifies buffers in shared memory */
+	size_t length;
+	size_t mask; /* applied to head and tail to get an index into buffer */
+	int flags;
+	/* Readiness eventfds handed out by cb_get_read_fd/cb_get_write_fd. */
+	int read_fd;
+	int write_fd;
+	size_t read_threshold;
+	size_t write_threshold;
+	struct cb_lock_profile *lock_profile; /* CB_LOCK_PROFILE builds only */
+	struct cb_residence *residence; /* CB_LATENCY write timestamps */
+
 #ifdef WIN32
-	HANDLE mutex;
+	CB_CACHELINE HANDLE mutex;
 #else
-	pthread_mutex_t mutex;
+	CB_CACHELINE pthread_mutex_t mutex;
 #endif
+	size_t stat_lock_contended; /* CB_STATS, only written with the mutex held */
+
+	/* Producer side: head and the last tail it has seen. */
+	CB_CACHELINE size_t head;
+	size_t cached_tail;
+	size_t reserve; /* end of the claimed bytes in CB_MPSC mode */
+	size_t dropped; /* bytes overwritten in CB_OVERWRITE mode */
+
+	/* Consumer side: tail and the last head it has seen. */
+	CB_CACHELINE size_t tail;
+	size_t cached_head;
+	int splice_fds[2]; /* pipe used by cb_splice_out, created on first use */
+	size_t splice_pending; /* bytes taken from the buffer, still in that pipe */
+
+	/* CB_STATS counters, each side's on a line of its own. */
+	CB_CACHELINE size_t stat_writes;
+	size_t stat_bytes_written;
+	size_t stat_writes_rejected;
+	size_t stat_high_water;
+	unsigned long long stat_write_wait_ns;
+	CB_CACHELINE size_t stat_reads;
+	size_t stat_bytes_read;
+	size_t stat_reads_short;
+	unsigned long long stat_read_wait_ns;
+
+	/* Threads parked in cb_read_wait/cb_write_wait and their wake words. */
+	CB_CACHELINE int read_waiters;
+	int write_waiters;
+	unsigned int read_seq;
+	unsigned int write_seq;
+	int read_signalled;
+	int write_signalled;
+};
+
+/* Snapshot of the counters of a CB_STATS buffer, see cb_get_stats(). */
+struct cb_stats {
+	size_t writes; /* successful writes, including commits and records */
+	size_t bytes_written;
+	size_t writes_rejected; /* writes that did not fit and stored nothing */
+	size_t reads; /* reads and consumes that removed data */
+	size_t bytes_read;
+	size_t reads_short; /* reads that returned less than asked, even none */
+	size_t high_water; /* most bytes ever held at once */
+	size_t lock_contended; /* times the mutex was found taken */
+	unsigned long long write_wait_ns; /* time parked in cb_write_wait */
+	unsigned long long read_wait_ns; /* time parked in cb_read_wait */
+};
+
+/*
+ * Mutex wait profile of a buffer, see cb_get_lock_profile(). Bucket `i` of
+ * `blocked` counts the contended acquisitions that waited [2^i, 2^(i+1))
+ * nanoseconds; the last bucket also takes everything longer.
+ */
+#define CB_LOCK_BUCKETS 32
+
+struct cb_lock_profile {
+	size_t acquisitions;
+	size_t contended;
+	unsigned long long blocked_ns; /* total time spent waiting */
+	size_t blocked[CB_LOCK_BUCKETS];
+};
+
+/*
+ * Histogram of how long data of a CB_LATENCY buffer waited between being
+ * written and being read, see cb_get_latency(). Values below
+ * 2^CB_LATENCY_SUB_BITS nanoseconds get a bucket each; every power of two
+ * above is split into 2^CB_LATENCY_SUB_BITS buckets, so a bucket is never
+ * wider than about 6% of its values. The last bucket starts at 31 * 2^35
+ * nanoseconds, about 17.7 minutes, and also takes everything longer.
+ */
+#define CB_LATENCY_SUB_BITS 4
+#define CB_LATENCY_BUCKETS 592
+
+struct cb_latency {
+	size_t count; /* writes read in full */
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+	size_t buckets[CB_LATENCY_BUCKETS];
 };
 
 CBAPI struct circular_buffer * CBCALL cb_create(int length);
+CBAPI struct circular_buffer * CBCALL cb_create64(size_t length);
+CBAPI struct circular_buffer * CBCALL cb_create_flags(size_t length, int flags);
+CBAPI struct circular_buffer * CBCALL cb_create_spsc(int length);
+CBAPI struct circular_buffer * CBCALL cb_create_shm(const char *name, size_t length, int flags);
+CBAPI struct circular_buffer * CBCALL cb_open_shm(const char *name);
+CBAPI int CBCALL cb_unlink_shm(const char *name);
 CBAPI void CBCALL cb_destroy(struct circular_buffer *buffer);
 CBAPI int CBCALL cb_read(struct circular_buffer *buffer, char *target, int amount);
+CBAPI ssize_t CBCALL cb_read64(struct circular_buffer *buffer, char *target, size_t amount);
 CBAPI int CBCALL cb_read_single(struct circular_buffer *buffer, char *target);
+CBAPI int CBCALL cb_read_wait(struct circular_buffer *buffer, char *target,
+		int min, int max, long long timeout_ns);
+CBAPI size_t CBCALL cb_read_peek(struct circular_buffer *buffer,
+		char **seg1, size_t *len1, char **seg2, size_t *len2);
+CBAPI ssize_t CBCALL cb_read_consume(struct circular_buffer *buffer, size_t amount);
 CBAPI int CBCALL cb_write(struct circular_buffer *buffer, char *data, int length);
+CBAPI ssize_t CBCALL cb_write64(struct circular_buffer *buffer, char *data, size_t length);
+CBAPI int CBCALL cb_write_some(struct circular_buffer *buffer, char *data, int length);
+CBAPI ssize_t CBCALL cb_write_some64(struct circular_buffer *buffer, char *data, size_t length);
+CBAPI int CBCALL cb_write_wait(struct circular_buffer *buffer, char *data,
+		int amount, long long timeout_ns);
+CBAPI ssize_t CBCALL cb_write_reserve(struct circular_buffer *buffer, size_t min,
+		char **seg1, size_t *len1, char **seg2, size_t *len2);
+CBAPI ssize_t CBCALL cb_write_commit(struct circular_buffer *buffer, size_t amount);
 CBAPI int CBCALL cb_empty(struct circular_buffer *buffer);
 CBAPI int CBCALL cb_full(struct circular_buffer *buffer);
 CBAPI int CBCALL cb_available_data(struct circular_buffer *buffer);
 CBAPI int CBCALL cb_available_space(struct circular_buffer *buffer);
+CBAPI size_t CBCALL cb_available_data64(struct circular_buffer *buffer);
+CBAPI size_t CBCALL cb_available_space64(struct circular_buffer *buffer);
+CBAPI ssize_t CBCALL cb_write_from_fd(struct circular_buffer *buffer, int fd, size_t max);
+CBAPI ssize_t CBCALL cb_read_to_fd(struct circular_buffer *buffer, int fd, size_t max);
+CBAPI ssize_t CBCALL cb_splice_out(struct circular_buffer *buffer, int fd, size_t max);
+CBAPI ssize_t CBCALL cb_msg_write(struct circular_buffer *buffer, char *data, size_t length);
+CBAPI ssize_t CBCALL cb_msg_read(struct circular_buffer *buffer, char *target, size_t size);
+CBAPI ssize_t CBCALL cb_msg_read_batch(struct circular_buffer *buffer, char *target, size_t size, size_t *lengths, size_t count);
+CBAPI ssize_t CBCALL cb_msg_peek(struct circular_buffer *buffer, char **seg1, size_t *len1, char **seg2, size_t *len2);
+CBAPI ssize_t CBCALL cb_msg_consume(struct circular_buffer *buffer);
+CBAPI int CBCALL cb_get_read_fd(struct circular_buffer *buffer);
+CBAPI int CBCALL cb_get_write_fd(struct circular_buffer *buffer);
+CBAPI int CBCALL cb_set_read_threshold(struct circular_buffer *buffer, size_t threshold);
+CBAPI int CBCALL cb_set_write_threshold(struct circular_buffer *buffer, size_t threshold);
+CBAPI size_t CBCALL cb_dropped(struct circular_buffer *buffer);
+CBAPI int CBCALL cb_get_stats(struct circular_buffer *buffer, struct cb_stats *stats);
+CBAPI int CBCALL cb_get_latency(struct circular_buffer *buffer, struct cb_latency *latency);
+CBAPI int CBCALL cb_reset_latency(struct circular_buffer *buffer);
+CBAPI unsigned long long CBCALL cb_latency_percentile(const struct cb_latency *latency, double percentile);
+CBAPI int CBCALL cb_get_lock_profile(struct circular_buffer *buffer, struct cb_lock_profile *profile);
 CBAPI void CBCALL cb_debug(struct circular_buffer *buf);
 CBAPI void CBCALL cb_clear(struct circular_buffer *buf);
 
+/*
+ * Lock-free multi-producer/multi-consumer queue of fixed-size slots.
+ */
+struct cb_mpmc;
+
+CBAPI struct cb_mpmc * CBCALL cb_mpmc_create(size_t slots, size_t slot_size);
+CBAPI void CBCALL cb_mpmc_destroy(struct cb_mpmc *ring);
+CBAPI int CBCALL cb_mpmc_push(struct cb_mpmc *ring, char *data);
+CBAPI int CBCALL cb_mpmc_pop(struct cb_mpmc *ring, char *target);
+CBAPI size_t CBCALL cb_mpmc_capacity(struct cb_mpmc *ring);
+
+/*
+ * Single-producer ring where every reader sees every byte.
+ */
+struct cb_broadcast;
+struct cb_broadcast_reader;
+
+CBAPI struct cb_broadcast * CBCALL cb_broadcast_create(size_t length, int max_readers, int flags);
+CBAPI void CBCALL cb_broadcast_destroy(struct cb_broadcast *ring);
+CBAPI struct cb_broadcast_reader * CBCALL cb_broadcast_join(struct cb_broadcast *ring);
+CBAPI void CBCALL cb_broadcast_leave(struct cb_broadcast_reader *reader);
+CBAPI ssize_t CBCALL cb_broadcast_write(struct cb_broadcast *ring, char *data, size_t amount);
+CBAPI size_t CBCALL cb_broadcast_peek(struct cb_broadcast_reader *reader, char **seg1, size_t *len1, char **seg2, size_t *len2);
+CBAPI ssize_t CBCALL cb_broadcast_consume(struct cb_broadcast_reader *reader, size_t amount);
+CBAPI ssize_t CBCALL cb_broadcast_read(struct cb_broadcast_reader *reader, char *target, size_t amount);
+
+/*
+ * io_uring engine keeping reads into and writes out of many buffers in
+ * flight at once. Linux only.
+ */
+#define CB_URING_FILL 0x1 /* read from the descriptor into the buffer */
+#define CB_URING_DRAIN 0x2 /* write the buffer's data to the descriptor */
+
+struct cb_uring;
+
+CBAPI struct cb_uring * CBCALL cb_uring_create(unsigned int entries);
+CBAPI void CBCALL cb_uring_destroy(struct cb_uring *ring);
+CBAPI int CBCALL cb_uring_add(struct cb_uring *ring, struct circular_buffer *buffer, int fd, int flags);
+CBAPI int CBCALL cb_uring_run(struct cb_uring *ring, unsigned int wait);
+CBAPI int CBCALL cb_uring_status(struct cb_uring *ring, int id);
+
 #define cb_full(B) (cb_available_space((B)) == 0)
 #define cb_empty(B) (cb_available_data((B)) == 0)
-#define cb_starts_at(B) ((B)->buffer + (B)->tail)
-#define cb_ends_at(B) ((B)->buffer + (B)->head)
-#define cb_commit_read(B, A) ((B)->tail = ((B)->tail + (A)) % (B)->length)
-#define cb_commit_write(B, A) ((B)->head = ((B)->head + (A)) % (B)->length)
+#define cb_storage(B) ((char *)((uintptr_t)(B) + (B)->data_offset))
+#define cb_starts_at(B) (cb_storage(B) + ((B)->tail & (B)->mask))
+#define cb_ends_at(B) (cb_storage(B) + ((B)->head & (B)->mask))
+#define cb_commit_read(B, A) cb_read_consume((B), (A))
+#define cb_commit_write(B, A) cb_write_commit((B), (A))
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,215 @@
+#ifndef CIRCULAR_BUFFER_HPP
+#define CIRCULAR_BUFFER_HPP
+
+/*
+ * Typed, fixed capacity counterpart of struct circular_buffer for C++17.
+ * Elements live inline in the ring, so there is no heap allocation and no
+ * copying through bytes. Use struct circular_buffer when the size is only
+ * known at run time.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "circular_buffer.h"
+
+namespace cb {
+
+/**
+ * Ring of up to `N` elements of type `T`.
+ *
+ * Like CB_SPSC, one thread may push while another one pops without a lock.
+ * Everything else (clear, destruction) needs the ring to be otherwise idle.
+ *
+ * When `N` is a power of two head and tail are free-running counters that
+ * are masked on access; otherwise they wrap at 2 * N so full and empty still
+ * differ.
+ */
+template <typename T, std::size_t N>
+class ring {
+	static_assert(N > 0, "cb::ring needs a capacity of at least one");
+	static_assert(N <= static_cast<std::size_t>(-1) / 4, "cb::ring capacity too large");
+
+public:
+	using value_type = T;
+	using size_type = std::size_t;
+
+	ring() noexcept : head_(0), tail_(0) {}
+	ring(const ring &) = delete;
+	ring &operator=(const ring &) = delete;
+
+	~ring()
+	{
+		clear();
+	}
+
+	static constexpr size_type capacity() noexcept
+	{
+		return N;
+	}
+
+	size_type size() const noexcept
+	{
+		return distance(tail_.load(std::memory_order_acquire),
+			head_.load(std::memory_order_acquire));
+	}
+
+	bool empty() const noexcept
+	{
+		return size() == 0;
+	}
+
+	bool full() const noexcept
+	{
+		return size() == N;
+	}
+
+	/**
+	 * Constructs an element in place at the back of the ring.
+	 *
+	 * @return false if the ring is full, in which case nothing is built.
+	 */
+	template <typename... Args>
+	bool emplace(Args &&... args)
+	{
+		size_type head = head_.load(std::memory_order_relaxed);
+
+		if (distance(tail_.load(std::memory_order_acquire), head) == N)
+			return false;
+		::new (static_cast<void *>(slots_[index(head)].bytes))
+			T(std::forward<Args>(args)...);
+		head_.store(next(head), std::memory_order_release);
+
+		return true;
+	}
+
+	bool push(const T &value)
+	{
+		return emplace(value);
+	}
+
+	bool push(T &&value)
+	{
+		return emplace(std::move(value));
+	}
+
+	/**
+	 * Move-constructs the oldest element out of the ring and destroys it
+	 * there, so `T` only needs to be move-constructible.
+	 *
+	 * @return The element, or std::nullopt if the ring is empty.
+	 */
+	std::optional<T> pop()
+	{
+		size_type tail = tail_.load(std::memory_order_relaxed);
+
+		if (head_.load(std::memory_order_acquire) == tail)
+			return std::nullopt;
+		T &value = at(tail);
+		std::optional<T> target(std::move(value));
+		destroy(value);
+		tail_.store(next(tail), std::memory_order_release);
+
+		return target;
+	}
+
+	/**
+	 * Move-assigns the oldest element to `target` and destroys it in the
+	 * ring. A convenience for reusing `target` across pops.
+	 *
+	 * @return false if the ring is empty.
+	 */
+	bool pop(T &target)
+	{
+		size_type tail = tail_.load(std::memory_order_relaxed);
+
+		if (head_.load(std::memory_order_acquire) == tail)
+			return false;
+		T &value = at(tail);
+		target = std::move(value);
+		destroy(value);
+		tail_.store(next(tail), std::memory_order_release);
+
+		return true;
+	}
+
+	/**
+	 * @return The oldest element, or nullptr if the ring is empty. It stays
+	 *         valid until the consumer pops it.
+	 */
+	T *front() noexcept
+	{
+		size_type tail = tail_.load(std::memory_order_relaxed);
+
+		if (head_.load(std::memory_order_acquire) == tail)
+			return nullptr;
+		return &at(tail);
+	}
+
+	void clear() noexcept
+	{
+		size_type tail = tail_.load(std::memory_order_relaxed);
+		size_type head = head_.load(std::memory_order_acquire);
+
+		for (; tail != head; tail = next(tail))
+			destroy(at(tail));
+		tail_.store(tail, std::memory_order_release);
+	}
+
+private:
+	static constexpr bool pow2 = (N & (N - 1)) == 0;
+
+	static constexpr size_type index(size_type pos) noexcept
+	{
+		if constexpr (pow2)
+			return pos & (N - 1);
+		else
+			return pos < N ? pos : pos - N;
+	}
+
+	static constexpr size_type next(size_type pos) noexcept
+	{
+		if constexpr (pow2)
+			return pos + 1;
+		else
+			return pos + 1 == 2 * N ? 0 : pos + 1;
+	}
+
+	static constexpr size_type distance(size_type tail, size_type head) noexcept
+	{
+		if constexpr (pow2)
+			return head - tail;
+		else
+			return head >= tail ? head - tail : 2 * N - tail + head;
+	}
+
+	/* The element at `pos`, laundered since it was built by placement new. */
+	T &at(size_type pos) noexcept
+	{
+		return *std::launder(reinterpret_cast<T *>(slots_[index(pos)].bytes));
+	}
+
+	static void destroy(T &value) noexcept
+	{
+		if constexpr (!std::is_trivially_destructible_v<T>)
+			value.~T();
+	}
+
+	/* Storage for a T; the ring manages the lifetime of what it holds. */
+	struct slot {
+		alignas(T) unsigned char bytes[sizeof(T)];
+	};
+
+	/* Producer and consumer indices on their own cache lines. */
+	alignas(CB_CACHELINE_SIZE) std::atomic<size_type> head_;
+	alignas(CB_CACHELINE_SIZE) std::atomic<size_type> tail_;
+	alignas(CB_CACHELINE_SIZE) slot slots_[N];
+};
+
+} /* namespace cb */
+
+#endif /* CIRCULAR_BUFFER_HPP */
@@ -8,7 +8,8 @@
 #define DATA_SIZE 256
 
 static struct option _options[] = {
-	 { "buffer", no_argument, 0, 'b' },
+	 { "buffer", required_argument, 0, 'b' },
+	 { 0, 0, 0, 0 },
 };
 
 int main(int argc, char **argv)
@@ -25,7 +26,7 @@ int main(int argc, char **argv)
 		}
 	}
 
-	b = circular_buffer_create(buffer_size);
+	b = cb_create(buffer_size);
 
 	if (!b) return -1;
 
@@ -37,28 +38,27 @@ int main(int argc, char **argv)
 	}
 
 	for (i = optind; i < argc; i++) {
-		int written = 0;
-		do {
-			if (circular_buffer_full(b)) {
-				ret = circular_buffer_read(b, data, sizeof(data));
+		int written = 0, length = strlen(argv[i]);
+		while (written < length) {
+			if (cb_full(b)) {
+				ret = cb_read(b, data, DATA_SIZE);
 				data[ret] = 0;
 				fprintf(stderr, "read\t'%s'\n", data);
 				memset(data, 0, sizeof(data));
 			}
 
-			ret = circular_buffer_write(b, argv[i] + written, circular_buffer_available_space(b));
-			/* If write was successful, inform user what was written. */
-			char copy[ret + 1];
-			snprintf(copy, ret + 1, "%s", argv[i] + written);
-			if (ret > 0) printf("write\t'%s'\n", copy);
+			/* Writes whatever fits, no need to check the free space first. */
+			ret = cb_write_some(b, argv[i] + written, length - written);
+			if (ret > 0) printf("write\t'%.*s'\n", ret, argv[i] + written);
 			written += ret;
-		} while (written <= strlen(argv[i]));
+		}
 	}
 
-	circular_buffer_read(b, data, sizeof(data));
-	data[DATA_SIZE] = 0;
+	ret = cb_read(b, data, DATA_SIZE);
+	data[ret] = 0;
+	fprintf(stderr, "read\t'%s'\n", data);
 
-	circular_buffer_destroy(b);
+	cb_destroy(b);
 
 	return 0;
 }
@@ -0,0 +1,49 @@
+#ifndef CB_INTERNAL_H
+#define CB_INTERNAL_H
+
+/*
+ * Helpers shared by the ring implementations. Not part of the installed API.
+ */
+
+#include <stddef.h>
+
+/* Memory ordering. */
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_ATOMICS
+#define load_relaxed(P) __atomic_load_n((P), __ATOMIC_RELAXED)
+#define load_acquire(P) __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define store_relaxed(P, V) __atomic_store_n((P), (V), __ATOMIC_RELAXED)
+#define store_release(P, V) __atomic_store_n((P), (V), __ATOMIC_RELEASE)
+#define fetch_add(P, V) __atomic_fetch_add((P), (V), __ATOMIC_SEQ_CST)
+#define exchange(P, V) __atomic_exchange_n((P), (V), __ATOMIC_SEQ_CST)
+#define compare_exchange(P, E, V) __atomic_compare_exchange_n((P), (E), (V), \
+	0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define full_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else /* No atomics: lock-free modes fall back to the mutex or are refused. */
+#define load_relaxed(P) (*(P))
+#define load_acquire(P) (*(P))
+#define store_relaxed(P, V) (*(P) = (V))
+#define store_release(P, V) (*(P) = (V))
+/* 64-bit operands, like the CB_STATS wait times, need the 64-bit add. */
+#define fetch_add(P, V) (sizeof(*(P)) == 8 \
+	? InterlockedExchangeAdd64((volatile LONG64 *)(P), (V)) \
+	: InterlockedExchangeAdd((volatile LONG *)(P), (V)))
+#define exchange(P, V) InterlockedExchange((volatile LONG *)(P), (V))
+#define compare_exchange(P, E, V) \
+	(InterlockedCompareExchange((volatile LONG *)(P), (V), *(E)) == *(E))
+#define full_fence() MemoryBarrier()
+#endif
+
+/* Allocation aligned to CB_CACHELINE_SIZE, released with _cb_free_aligned. */
+void *_cb_alloc_aligned(size_t size);
+void _cb_free_aligned(void *ptr);
+
+/*
+ * Maps `size` bytes twice, back to back, so accesses running off the end
+ * continue at the start. `size` must be a multiple of _cb_page_size().
+ */
+size_t _cb_page_size(void);
+char *_cb_mirror_map(size_t size);
+void _cb_mirror_unmap(char *addr, size_t size);
+
+#endif /* CB_INTERNAL_H */
@@ -3,6 +3,19 @@
 #include "catch.hpp"
 
 #include <circular_buffer.h>
+#include <circular_buffer.hpp>
+
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <limits.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <memory>
+#include <optional>
+#include <string>
 
 #ifdef _WIN32
 #define snprintf _snprintf_s
@@ -601,3 +614,1381 @@ TEST_CASE("Random buffer size and rounds", "[read][write][random]")
 	/* There should be no remaining data. */
 	REQUIRE(cb_available_data(buffer) == 0);
 }
+
+TEST_CASE("Circular buffer SPSC multithreading", "[read][write][multithread][spsc]")
+{
+	int i, ret, value;
+	struct circular_buffer *buffer;
+	pthread_t thread;
+	const unsigned int VERIFY_NUM = 100000;
+	char data[4];
+
+	buffer = cb_create_spsc(12);
+	REQUIRE(buffer != 0);
+	REQUIRE((buffer->flags & CB_SPSC) != 0);
+
+	_running = 1;
+	ret = pthread_create(&thread, NULL, &cb_write_thread, buffer);
+	REQUIRE(ret == 0);
+
+	/* Same as above, but without the mutex protecting head and tail. */
+	for (i = 0; i < VERIFY_NUM; i++) {
+retry:
+		ret = cb_read(buffer, data, 4);
+		if (ret < 1) { goto retry; }
+		REQUIRE(ret == 4);
+		value = ((data[0] << 24) & 0xff000000) |
+			((data[1] << 16) & 0xff0000) |
+			((data[2] << 8) & 0xff00) |
+			(data[3] & 0xff);
+		if (value != i) {
+			_running = 0;
+			FAIL("SPSC data is not syncronized.");
+			break;
+		}
+	}
+
+	_running = 0;
+	pthread_join(thread, NULL);
+	cb_destroy(buffer);
+}
+
+TEST_CASE("Circular buffer mirrored wraps contiguously", "[read][write][mirrored]")
+{
+	char data[64], validate[64];
+	struct circular_buffer *buffer;
+	int i, ret, size;
+
+	buffer = cb_create_flags(100, CB_MIRRORED);
+	REQUIRE(buffer != 0);
+	/* The storage is rounded up to whole pages. */
+	size = buffer->length + 1;
+	REQUIRE(buffer->length >= 100);
+	REQUIRE((size % sysconf(_SC_PAGESIZE)) == 0);
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i;
+
+	/* Move head and tail close to the end of the storage. */
+	ret = cb_write(buffer, data, 32);
+	REQUIRE(ret == 32);
+	while (buffer->head < size - 32) {
+		ret = cb_write(buffer, data, 16);
+		REQUIRE(ret == 16);
+		ret = cb_read(buffer, validate, 16);
+		REQUIRE(ret == 16);
+	}
+	ret = cb_read(buffer, validate, cb_available_data(buffer));
+
+	/* This write wraps, yet it is readable as one span at cb_starts_at. */
+	ret = cb_write(buffer, data, sizeof(data));
+	REQUIRE(ret == sizeof(data));
+	REQUIRE(buffer->head < buffer->tail);
+	REQUIRE(memcmp(cb_starts_at(buffer), data, sizeof(data)) == 0);
+
+	ret = cb_read(buffer, validate, sizeof(validate));
+	REQUIRE(ret == sizeof(validate));
+	REQUIRE(memcmp(validate, data, sizeof(data)) == 0);
+	REQUIRE(cb_empty(buffer));
+
+	cb_destroy(buffer);
+}
+
+TEST_CASE("Circular buffer write reserve and commit", "[write][zerocopy]")
+{
+	const int SIZE = 10;
+	char data[SIZE], validate[SIZE], *seg1, *seg2;
+	struct circular_buffer *buffer;
+	int i, ret;
+	size_t len1, len2;
+
+	buffer = cb_create(SIZE);
+	REQUIRE(buffer != 0);
+
+	for (i = 0; i < SIZE; i++)
+		data[i] = i;
+
+	/* An empty buffer hands out all of its space in one span. */
+	ret = cb_write_reserve(buffer, 1, &seg1, &len1, &seg2, &len2);
+	REQUIRE(ret == SIZE);
+	REQUIRE(seg1 == buffer->buffer);
+	REQUIRE(len1 == SIZE);
+	REQUIRE(len2 == 0);
+	memcpy(seg1, data, 6);
+	/* Nothing is readable until it is committed. */
+	REQUIRE(cb_available_data(buffer) == 0);
+	REQUIRE(cb_write_commit(buffer, 6) == 6);
+	REQUIRE(cb_available_data(buffer) == 6);
+	REQUIRE(cb_read(buffer, validate, 6) == 6);
+	REQUIRE(memcmp(validate, data, 6) == 0);
+
+	/* Now the free space wraps around the end of the storage. */
+	ret = cb_write_reserve(buffer, SIZE, &seg1, &len1, &seg2, &len2);
+	REQUIRE(ret == SIZE);
+	REQUIRE(seg1 == buffer->buffer + 6);
+	REQUIRE(len1 == SIZE + 1 - 6);
+	REQUIRE(seg2 == buffer->buffer);
+	REQUIRE(len2 == SIZE - len1);
+	memcpy(seg1, data, len1);
+	memcpy(seg2, data + len1, len2);
+	REQUIRE(cb_write_commit(buffer, SIZE) == SIZE);
+	REQUIRE(cb_full(buffer));
+	REQUIRE(cb_read(buffer, validate, SIZE) == SIZE);
+	REQUIRE(memcmp(validate, data, SIZE) == 0);
+
+	/* Asking for more than the contiguous span fails without seg2. */
+	ret = cb_write_reserve(buffer, SIZE, &seg1, &len1, NULL, NULL);
+	REQUIRE(ret == -1);
+	ret = cb_write_reserve(buffer, 1, &seg1, &len1, NULL, NULL);
+	REQUIRE(ret == len1);
+
+	/* Committing more than is free is rejected. */
+	REQUIRE(cb_write_commit(buffer, SIZE + 1) == -1);
+	REQUIRE(cb_available_data(buffer) == 0);
+
+	cb_destroy(buffer);
+}
+
+TEST_CASE("Circular buffer read peek and consume", "[read][zerocopy]")
+{
+	const int SIZE = 10;
+	char data[SIZE], *seg1, *seg2;
+	struct circular_buffer *buffer;
+	int i, ret;
+	size_t len1, len2;
+
+	buffer = cb_create(SIZE);
+	REQUIRE(buffer != 0);
+
+	for (i = 0; i < SIZE; i++)
+		data[i] = i;
+
+	/* Nothing to see in an empty buffer. */
+	ret = cb_read_peek(buffer, &seg1, &len1, &seg2, &len2);
+	REQUIRE(ret == 0);
+	REQUIRE(len1 == 0);
+	REQUIRE(len2 == 0);
+
+	REQUIRE(cb_write(buffer, data, 8) == 8);
+	ret = cb_read_peek(buffer, &seg1, &len1, &seg2, &len2);
+	REQUIRE(ret == 8);
+	REQUIRE(seg1 == buffer->buffer);
+	REQUIRE(len1 == 8);
+	REQUIRE(len2 == 0);
+	REQUIRE(memcmp(seg1, data, 8) == 0);
+	/* Peeking does not release anything. */
+	REQUIRE(cb_available_data(buffer) == 8);
+	REQUIRE(cb_read_consume(buffer, 8) == 8);
+	REQUIRE(cb_available_data(buffer) == 0);
+
+	/* Data that wraps is handed out as two spans. */
+	REQUIRE(cb_write(buffer, data, SIZE) == SIZE);
+	ret = cb_read_peek(buffer, &seg1, &len1, &seg2, &len2);
+	REQUIRE(ret == SIZE);
+	REQUIRE(seg1 == buffer->buffer + 8);
+	REQUIRE(len1 == SIZE + 1 - 8);
+	REQUIRE(seg2 == buffer->buffer);
+	REQUIRE(len2 == SIZE - len1);
+	REQUIRE(memcmp(seg1, data, len1) == 0);
+	REQUIRE(memcmp(seg2, data + len1, len2) == 0);
+
+	/* Without seg2 only the contiguous span is reported. */
+	ret = cb_read_peek(buffer, &seg1, &len1, NULL, NULL);
+	REQUIRE(ret == len1);
+
+	/* Releasing part of the data keeps the rest readable. */
+	REQUIRE(cb_read_consume(buffer, 4) == 4);
+	REQUIRE(cb_available_data(buffer) == SIZE - 4);
+	REQUIRE(cb_read_consume(buffer, SIZE) == -1);
+	REQUIRE(cb_available_data(buffer) == SIZE - 4);
+
+	cb_destroy(buffer);
+}
+
+static void* cb_write_wait_thread(void *circular_buffer)
+{
+	int i, ret;
+	struct circular_buffer *buffer = (struct circular_buffer*) circular_buffer;
+	char data[4];
+
+	for (i = 0; i < 10000; i++) {
+		data[0] = (i >> 24) & 0xff;
+		data[1] = (i >> 16) & 0xff;
+		data[2] = (i >> 8) & 0xff;
+		data[3] = i & 0xff;
+		ret = cb_write_wait(buffer, data, 4, -1);
+		if (ret != 4)
+			break;
+	}
+	return 0;
+}
+
+TEST_CASE("Circular buffer blocking read and write", "[read][write][multithread][wait]")
+{
+	int i, ret, value;
+	struct circular_buffer *buffer;
+	pthread_t thread;
+	char data[4];
+
+	buffer = cb_create(12);
+	REQUIRE(buffer != 0);
+
+	/* Nothing was written, so a bounded wait times out. */
+	ret = cb_read_wait(buffer, data, 1, sizeof(data), 1000000);
+	REQUIRE(ret == -1);
+	REQUIRE(errno == ETIMEDOUT);
+	/* A request that can never be satisfied is refused up front. */
+	ret = cb_read_wait(buffer, data, 13, 13, -1);
+	REQUIRE(ret == -1);
+	REQUIRE(errno == EINVAL);
+
+	ret = pthread_create(&thread, NULL, &cb_write_wait_thread, buffer);
+	REQUIRE(ret == 0);
+
+	/* Neither side retries by hand; both sleep until the other catches up. */
+	for (i = 0; i < 10000; i++) {
+		ret = cb_read_wait(buffer, data, 4, 4, -1);
+		REQUIRE(ret == 4);
+		value = ((data[0] << 24) & 0xff000000) |
+			((data[1] << 16) & 0xff0000) |
+			((data[2] << 8) & 0xff00) |
+			(data[3] & 0xff);
+		if (value != i)
+			FAIL("Blocking data is not syncronized.");
+	}
+
+	pthread_join(thread, NULL);
+
+	/* The buffer is full, so a bounded write times out. */
+	REQUIRE(cb_write(buffer, data, 12) == 12);
+	ret = cb_write_wait(buffer, data, 1, 0);
+	REQUIRE(ret == -1);
+	REQUIRE(errno == ETIMEDOUT);
+
+	cb_destroy(buffer);
+}
+
+static int readable(int fd)
+{
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+TEST_CASE("Circular buffer readiness eventfds", "[read][write][eventfd]")
+{
+	const int SIZE = 10;
+	char data[SIZE];
+	struct circular_buffer *buffer;
+	int read_fd, write_fd;
+
+	buffer = cb_create(SIZE);
+	REQUIRE(buffer != 0);
+
+	read_fd = cb_get_read_fd(buffer);
+	write_fd = cb_get_write_fd(buffer);
+	REQUIRE(read_fd >= 0);
+	REQUIRE(write_fd >= 0);
+	/* The same descriptor is handed out every time. */
+	REQUIRE(cb_get_read_fd(buffer) == read_fd);
+
+	/* An empty buffer has space but no data. */
+	REQUIRE(!readable(read_fd));
+	REQUIRE(readable(write_fd));
+
+	/* A burst of writes signals once and stays signalled. */
+	REQUIRE(cb_write(buffer, data, 2) == 2);
+	REQUIRE(readable(read_fd));
+	REQUIRE(cb_write(buffer, data, 2) == 2);
+	REQUIRE(readable(read_fd));
+
+	/* Draining the data clears the readiness again. */
+	REQUIRE(cb_read(buffer, data, 4) == 4);
+	REQUIRE(!readable(read_fd));
+
+	/* With a threshold, a single byte is not enough. */
+	REQUIRE(cb_set_read_threshold(buffer, 4) == 0);
+	REQUIRE(cb_set_read_threshold(buffer, SIZE + 1) == -1);
+	REQUIRE(cb_write(buffer, data, 3) == 3);
+	REQUIRE(!readable(read_fd));
+	REQUIRE(cb_write(buffer, data, 1) == 1);
+	REQUIRE(readable(read_fd));
+
+	/* The write side follows the free space the same way. */
+	REQUIRE(cb_write(buffer, data, SIZE - 4) == SIZE - 4);
+	REQUIRE(!readable(write_fd));
+	REQUIRE(cb_read(buffer, data, 1) == 1);
+	REQUIRE(readable(write_fd));
+
+	cb_destroy(buffer);
+}
+
+TEST_CASE("Circular buffer power of two mode", "[read][write][pow2]")
+{
+	char data[128], validate[128];
+	struct circular_buffer *buffer;
+	int i, ret;
+
+	buffer = cb_create_flags(100, CB_POW2);
+	REQUIRE(buffer != 0);
+	/* The capacity is rounded up and all of it is usable. */
+	REQUIRE(buffer->length == 128);
+	REQUIRE(buffer->mask == 127);
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i;
+
+	ret = cb_write(buffer, data, 128);
+	REQUIRE(ret == 128);
+	REQUIRE(cb_full(buffer));
+	REQUIRE(cb_write(buffer, data, 1) == -1);
+
+	/* Head and tail keep counting past the end of the storage. */
+	for (i = 0; i < 10; i++) {
+		ret = cb_read(buffer, validate, 100);
+		REQUIRE(ret == 100);
+		ret = cb_write(buffer, data, 100);
+		REQUIRE(ret == 100);
+	}
+	REQUIRE(buffer->head == 128 + 10 * 100);
+	REQUIRE(buffer->tail == 10 * 100);
+	REQUIRE(cb_available_data(buffer) == 128);
+	REQUIRE(cb_starts_at(buffer) == buffer->buffer + (1000 & 127));
+	REQUIRE(cb_ends_at(buffer) == buffer->buffer + (1128 & 127));
+
+	/* The data comes back in order across the wrap. */
+	cb_clear(buffer);
+	REQUIRE(cb_write(buffer, data, 100) == 100);
+	REQUIRE(cb_read(buffer, validate, 100) == 100);
+	REQUIRE(cb_write(buffer, data, 128) == 128);
+	REQUIRE(cb_read(buffer, validate, 128) == 128);
+	REQUIRE(memcmp(validate, data, 128) == 0);
+	REQUIRE(cb_empty(buffer));
+
+	cb_destroy(buffer);
+}
+
+TEST_CASE("Circular buffer 64-bit sizes", "[read][write][64bit]")
+{
+	const size_t SIZE = (size_t)INT_MAX + 16;
+	char data[] = "beyond 2 GiB", validate[sizeof(data)];
+	struct circular_buffer *buffer;
+
+	/* Sizes that cannot be represented are refused instead of wrapping. */
+	buffer = cb_create64((size_t)-1);
+	REQUIRE(buffer == 0);
+	REQUIRE(errno == EINVAL);
+	REQUIRE(cb_create(-1) == 0);
+
+	buffer = cb_create64(SIZE);
+	if (!buffer) {
+		WARN("Could not allocate a buffer larger than 2 GiB, skipping.");
+		return;
+	}
+	REQUIRE(buffer->length == SIZE);
+	REQUIRE(cb_available_space64(buffer) == SIZE);
+	/* The int API saturates instead of overflowing. */
+	REQUIRE(cb_available_space(buffer) == INT_MAX);
+
+	REQUIRE(cb_write64(buffer, data, sizeof(data)) == (ssize_t)sizeof(data));
+	REQUIRE(cb_available_data64(buffer) == sizeof(data));
+	REQUIRE(cb_available_space64(buffer) == SIZE - sizeof(data));
+	REQUIRE(cb_read64(buffer, validate, SIZE) == (ssize_t)sizeof(data));
+	REQUIRE(memcmp(validate, data, sizeof(data)) == 0);
+
+	cb_destroy(buffer);
+}
+
+TEST_CASE("Circular buffer producer and consumer state layout", "[utility][layout]")
+{
+	struct circular_buffer *buffer;
+	size_t head = offsetof(struct circular_buffer, head);
+	size_t tail = offsetof(struct circular_buffer, tail);
+	size_t mutex = offsetof(struct circular_buffer, mutex);
+	size_t waiters = offsetof(struct circular_buffer, read_waiters);
+
+	/* Each group starts on its own cache line. */
+	REQUIRE((head % CB_CACHELINE_SIZE) == 0);
+	REQUIRE((tail % CB_CACHELINE_SIZE) == 0);
+	REQUIRE((mutex % CB_CACHELINE_SIZE) == 0);
+	REQUIRE((waiters % CB_CACHELINE_SIZE) == 0);
+	REQUIRE(offsetof(struct circular_buffer, cached_tail) < tail);
+	REQUIRE(offsetof(struct circular_buffer, cached_head) < waiters);
+	REQUIRE(offsetof(struct circular_buffer, length) < mutex);
+
+	/* And the allocation honours that alignment. */
+	buffer = cb_create(10);
+	REQUIRE(buffer != 0);
+	REQUIRE(((size_t)buffer % CB_CACHELINE_SIZE) == 0);
+	cb_destroy(buffer);
+}
+
+TEST_CASE("MPMC queue push and pop", "[mpmc]")
+{
+	struct cb_mpmc *ring;
+	int i, value;
+
+	ring = cb_mpmc_create(5, sizeof(int));
+	REQUIRE(ring != 0);
+	/* Capacity is rounded up to a power of two. */
+	REQUIRE(cb_mpmc_capacity(ring) == 8);
+
+	REQUIRE(cb_mpmc_pop(ring, (char *)&value) == -1);
+	for (i = 0; i < 8; i++)
+		REQUIRE(cb_mpmc_push(ring, (char *)&i) == 0);
+	REQUIRE(cb_mpmc_push(ring, (char *)&i) == -1);
+
+	/* Elements come back in order, across several laps. */
+	for (i = 0; i < 100; i++) {
+		int next = i + 8;
+		REQUIRE(cb_mpmc_pop(ring, (char *)&value) == 0);
+		REQUIRE(value == i);
+		REQUIRE(cb_mpmc_push(ring, (char *)&next) == 0);
+	}
+
+	cb_mpmc_destroy(ring);
+}
+
+#define MPMC_THREADS 4
+#define MPMC_ITEMS 20000
+
+static struct cb_mpmc *_mpmc;
+static volatile long long _mpmc_sum;
+
+static void* mpmc_producer(void *arg)
+{
+	int i, value;
+
+	for (i = 1; i <= MPMC_ITEMS; i++) {
+		value = i;
+		while (cb_mpmc_push(_mpmc, (char *)&value) < 0)
+			sched_yield();
+	}
+	return 0;
+}
+
+static void* mpmc_consumer(void *arg)
+{
+	int i, value;
+	long long sum = 0;
+
+	for (i = 0; i < MPMC_ITEMS; i++) {
+		while (cb_mpmc_pop(_mpmc, (char *)&value) < 0)
+			sched_yield();
+		sum += value;
+	}
+	__atomic_fetch_add(&_mpmc_sum, sum, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+TEST_CASE("MPMC queue multithreading", "[mpmc][multithread]")
+{
+	pthread_t producers[MPMC_THREADS], consumers[MPMC_THREADS];
+	long long expected;
+	int i;
+
+	_mpmc = cb_mpmc_create(16, sizeof(int));
+	REQUIRE(_mpmc != 0);
+	_mpmc_sum = 0;
+
+	for (i = 0; i < MPMC_THREADS; i++) {
+		REQUIRE(pthread_create(&producers[i], NULL, &mpmc_producer, NULL) == 0);
+		REQUIRE(pthread_create(&consumers[i], NULL, &mpmc_consumer, NULL) == 0);
+	}
+	for (i = 0; i < MPMC_THREADS; i++) {
+		pthread_join(producers[i], NULL);
+		pthread_join(consumers[i], NULL);
+	}
+
+	/* Every element was popped exactly once. */
+	expected = (long long)MPMC_THREADS * MPMC_ITEMS * (MPMC_ITEMS + 1) / 2;
+	REQUIRE(_mpmc_sum == expected);
+
+	cb_mpmc_destroy(_mpmc);
+}
+
+#define MPSC_PRODUCERS 4
+#define MPSC_RECORDS 20000
+
+static void* mpsc_producer(void *circular_buffer)
+{
+	static int next_id = 0;
+	struct circular_buffer *buffer = (struct circular_buffer*) circular_buffer;
+	int i, id = __atomic_fetch_add(&next_id, 1, __ATOMIC_SEQ_CST) % MPSC_PRODUCERS;
+	char data[4];
+
+	for (i = 0; i < MPSC_RECORDS; i++) {
+		data[0] = id;
+		data[1] = (i >> 16) & 0xff;
+		data[2] = (i >> 8) & 0xff;
+		data[3] = i & 0xff;
+		while (cb_write(buffer, data, sizeof(data)) < 0)
+			sched_yield();
+	}
+	return 0;
+}
+
+TEST_CASE("Circular buffer MPSC multithreading", "[read][write][multithread][mpsc]")
+{
+	struct circular_buffer *buffer;
+	pthread_t threads[MPSC_PRODUCERS];
+	int i, ret, id, value, next[MPSC_PRODUCERS] = { 0 };
+	char data[4], *seg1;
+	size_t len1;
+
+	buffer = cb_create_flags(60, CB_MPSC);
+	REQUIRE(buffer != 0);
+	/* MPSC uses free-running counters, so the capacity is a power of two. */
+	REQUIRE(buffer->length == 64);
+	/* Producers cannot share a reservation. */
+	REQUIRE(cb_write_reserve(buffer, 1, &seg1, &len1, NULL, NULL) == -1);
+
+	for (i = 0; i < MPSC_PRODUCERS; i++)
+		REQUIRE(pthread_create(&threads[i], NULL, &mpsc_producer, buffer) == 0);
+
+	/*
+	 * Every write is all or nothing, so records are never torn, and each
+	 * producer's records arrive in the order it wrote them.
+	 */
+	for (i = 0; i < MPSC_PRODUCERS * MPSC_RECORDS; i++) {
+		ret = cb_read_wait(buffer, data, 4, 4, -1);
+		REQUIRE(ret == 4);
+		id = data[0];
+		value = ((data[1] << 16) & 0xff0000) |
+			((data[2] << 8) & 0xff00) |
+			(data[3] & 0xff);
+		REQUIRE(id >= 0);
+		REQUIRE(id < MPSC_PRODUCERS);
+		if (value != next[id])
+			FAIL("MPSC records are out of order.");
+		next[id]++;
+	}
+
+	for (i = 0; i < MPSC_PRODUCERS; i++)
+		pthread_join(threads[i], NULL);
+	REQUIRE(cb_empty(buffer));
+
+	cb_destroy(buffer);
+}
+
+TEST_CASE("Broadcast readers each see every byte", "[broadcast]")
+{
+	struct cb_broadcast *ring;
+	struct cb_broadcast_reader *a, *b, *c;
+	char data[] = "0123456789abcdef", target[16];
+	char *seg1 = data, *seg2 = data;
+	size_t len1 = 1, len2 = 1;
+
+	ring = cb_broadcast_create(16, 2, 0);
+	REQUIRE(ring != 0);
+	a = cb_broadcast_join(ring);
+	b = cb_broadcast_join(ring);
+	REQUIRE(a != 0);
+	REQUIRE(b != 0);
+	REQUIRE(cb_broadcast_join(ring) == 0);
+
+	/* Readers start with the first write after joining. */
+	REQUIRE(cb_broadcast_peek(a, &seg1, &len1, &seg2, &len2) == 0);
+	REQUIRE(seg1 == 0);
+	REQUIRE(len1 == 0);
+	REQUIRE(seg2 == 0);
+	REQUIRE(len2 == 0);
+	REQUIRE(cb_broadcast_read(a, target, 16) == 0);
+	REQUIRE(cb_broadcast_write(ring, data, 10) == 10);
+	REQUIRE(cb_broadcast_read(a, target, 16) == 10);
+	REQUIRE(memcmp(target, data, 10) == 0);
+
+	/* b has not read anything, so there is only room for 6 more bytes. */
+	REQUIRE(cb_broadcast_write(ring, data + 10, 7) == -1);
+	REQUIRE(cb_broadcast_write(ring, data + 10, 6) == 6);
+	REQUIRE(cb_broadcast_read(b, target, 16) == 16);
+	REQUIRE(memcmp(target, data, 16) == 0);
+	/* Now a is the slowest reader. */
+	REQUIRE(cb_broadcast_write(ring, data, 11) == -1);
+
+	/* Leaving stops gating the producer and frees the slot. */
+	cb_broadcast_leave(a);
+	REQUIRE(cb_broadcast_write(ring, data, 10) == 10);
+	c = cb_broadcast_join(ring);
+	REQUIRE(c != 0);
+	REQUIRE(cb_broadcast_write(ring, data + 10, 6) == 6);
+	REQUIRE(cb_broadcast_read(c, target, 16) == 6);
+	REQUIRE(memcmp(target, data + 10, 6) == 0);
+	REQUIRE(cb_broadcast_read(b, target, 16) == 16);
+	REQUIRE(memcmp(target, data, 16) == 0);
+
+	cb_broadcast_destroy(ring);
+}
+
+#define BROADCAST_READERS 3
+#define BROADCAST_ITEMS 100000
+
+static void* broadcast_reader(void *reader)
+{
+	int expected = 0, value;
+
+	while (expected < BROADCAST_ITEMS) {
+		if (cb_broadcast_read((struct cb_broadcast_reader*) reader,
+				(char*) &value, sizeof(value)) < 1) {
+			sched_yield();
+			continue;
+		}
+		if (value != expected)
+			return (void*) 1;
+		expected++;
+	}
+	return 0;
+}
+
+TEST_CASE("Broadcast multithreading", "[broadcast][multithread]")
+{
+	struct cb_broadcast *ring;
+	struct cb_broadcast_reader *readers[BROADCAST_READERS];
+	pthread_t threads[BROADCAST_READERS];
+	void *ret;
+	int i;
+
+	ring = cb_broadcast_create(64, BROADCAST_READERS, CB_MIRRORED);
+	REQUIRE(ring != 0);
+	for (i = 0; i < BROADCAST_READERS; i++) {
+		readers[i] = cb_broadcast_join(ring);
+		REQUIRE(readers[i] != 0);
+		REQUIRE(pthread_create(&threads[i], NULL, &broadcast_reader, readers[i]) == 0);
+	}
+
+	/* Every reader gets the full sequence, in order, despite the small ring. */
+	for (i = 0; i < BROADCAST_ITEMS; i++) {
+		while (cb_broadcast_write(ring, (char*) &i, sizeof(i)) < 0)
+			sched_yield();
+	}
+	for (i = 0; i < BROADCAST_READERS; i++) {
+		pthread_join(threads[i], &ret);
+		REQUIRE(ret == 0);
+	}
+
+	cb_broadcast_destroy(ring);
+}
+
+TEST_CASE("Circular buffer overwrite drops the oldest data", "[write][overwrite]")
+{
+	struct circular_buffer *buffer;
+	char data[] = "0123456789abcdefghij", target[20];
+	int flags[] = { CB_OVERWRITE, CB_OVERWRITE | CB_POW2 };
+	size_t i, dropped;
+
+	REQUIRE(cb_create_flags(8, CB_OVERWRITE | CB_SPSC) == 0);
+	REQUIRE(cb_create_flags(8, CB_OVERWRITE | CB_MPSC) == 0);
+
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		buffer = cb_create_flags(8, flags[i]);
+		REQUIRE(buffer != 0);
+		REQUIRE(cb_dropped(buffer) == 0);
+
+		REQUIRE(cb_write(buffer, data, 6) == 6);
+		REQUIRE(cb_dropped(buffer) == 0);
+		/* Two of the oldest bytes make room for the new ones. */
+		REQUIRE(cb_write(buffer, data + 6, 4) == 4);
+		REQUIRE(cb_dropped(buffer) == 2);
+		REQUIRE(cb_full(buffer));
+		REQUIRE(cb_read(buffer, target, 3) == 3);
+		REQUIRE(memcmp(target, "234", 3) == 0);
+
+		/* A reader notices it was lapped by the counter moving. */
+		dropped = cb_dropped(buffer);
+		REQUIRE(cb_write(buffer, data + 10, 7) == 7);
+		REQUIRE(cb_dropped(buffer) == dropped + 4);
+		REQUIRE(cb_read(buffer, target, 20) == 8);
+		REQUIRE(memcmp(target, "9abcdefg", 8) == 0);
+
+		/* Only the end of a write larger than the buffer is kept. */
+		REQUIRE(cb_write(buffer, data, 20) == 20);
+		REQUIRE(cb_dropped(buffer) == dropped + 4 + 12);
+		REQUIRE(cb_read(buffer, target, 20) == 8);
+		REQUIRE(memcmp(target, "cdefghij", 8) == 0);
+
+		cb_destroy(buffer);
+	}
+}
+
+TEST_CASE("Circular buffer partial writes", "[write][partial]")
+{
+	struct circular_buffer *buffer;
+	char data[] = "0123456789", target[10];
+	int flags[] = { 0, CB_SPSC, CB_POW2, CB_MPSC };
+	size_t i;
+
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		buffer = cb_create_flags(8, flags[i]);
+		REQUIRE(buffer != 0);
+
+		REQUIRE(cb_write_some(buffer, data, 0) == 0);
+		REQUIRE(cb_write_some(buffer, data, 5) == 5);
+		/* Only what fits is taken, unlike cb_write. */
+		REQUIRE(cb_write(buffer, data + 5, 5) == -1);
+		REQUIRE(cb_write_some(buffer, data + 5, 5) == 3);
+		REQUIRE(cb_full(buffer));
+		REQUIRE(cb_write_some64(buffer, data + 8, 2) == 0);
+
+		REQUIRE(cb_read(buffer, target, 10) == 8);
+		REQUIRE(memcmp(target, data, 8) == 0);
+
+		cb_destroy(buffer);
+	}
+}
+
+TEST_CASE("Circular buffer records", "[msg]")
+{
+	struct circular_buffer *buffer;
+	char data[300], target[300], *seg1, *seg2;
+	size_t i, len1, len2, lengths[8];
+	int flags[] = { 0, CB_POW2, CB_SPSC, CB_MPSC };
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i;
+
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		buffer = cb_create_flags(256, flags[i]);
+		REQUIRE(buffer != 0);
+		errno = 0;
+		REQUIRE(cb_msg_read(buffer, target, sizeof(target)) == -1);
+		REQUIRE(errno == EAGAIN);
+		REQUIRE(cb_msg_write(buffer, data, 300) == -1);
+		REQUIRE(errno == EMSGSIZE);
+
+		/* A 200 byte payload needs a two byte header. */
+		REQUIRE(cb_msg_write(buffer, data, 200) == 200);
+		REQUIRE(cb_available_data(buffer) == 202);
+		REQUIRE(cb_msg_write(buffer, data, 100) == -1);
+		REQUIRE(cb_msg_read(buffer, target, 100) == -1);
+		REQUIRE(errno == EMSGSIZE);
+		REQUIRE(cb_msg_read(buffer, target, sizeof(target)) == 200);
+		REQUIRE(memcmp(target, data, 200) == 0);
+
+		/* This record wraps around the end of the storage. */
+		REQUIRE(cb_msg_write(buffer, data, 100) == 100);
+		REQUIRE(cb_msg_write(buffer, data + 100, 0) == 0);
+		REQUIRE(cb_msg_write(buffer, data + 100, 10) == 10);
+		REQUIRE(cb_msg_peek(buffer, &seg1, &len1, &seg2, &len2) == 100);
+		REQUIRE((len1 + len2) == 100);
+		REQUIRE(len2 > 0);
+		REQUIRE(memcmp(seg1, data, len1) == 0);
+		REQUIRE(memcmp(seg2, data + len1, len2) == 0);
+		/* Without seg2 only the contiguous span is exposed. */
+		REQUIRE(cb_msg_peek(buffer, &seg1, &len1, NULL, NULL) == 100);
+		REQUIRE(len1 == (100 - len2));
+		REQUIRE(cb_msg_consume(buffer) == 100);
+
+		REQUIRE(cb_msg_read_batch(buffer, target, sizeof(target), lengths, 8) == 2);
+		REQUIRE(lengths[0] == 0);
+		REQUIRE(lengths[1] == 10);
+		REQUIRE(memcmp(target, data + 100, 10) == 0);
+		REQUIRE(cb_empty(buffer));
+
+		cb_destroy(buffer);
+	}
+}
+
+TEST_CASE("Circular buffer records batch and overwrite", "[msg][overwrite]")
+{
+	struct circular_buffer *buffer;
+	char target[16], *seg1, *seg2;
+	size_t i, len1, len2, lengths[8];
+
+	buffer = cb_create_flags(12, CB_OVERWRITE);
+	REQUIRE(buffer != 0);
+	REQUIRE(cb_msg_write(buffer, (char*) "abc", 3) == 3);
+	REQUIRE(cb_msg_write(buffer, (char*) "defg", 4) == 4);
+	/* Records are dropped whole, not just the bytes needed. */
+	REQUIRE(cb_msg_write(buffer, (char*) "hijkl", 5) == 5);
+	REQUIRE(cb_dropped(buffer) == 4);
+	REQUIRE(cb_msg_write(buffer, (char*) "no", 2) == 2);
+	REQUIRE(cb_dropped(buffer) == 9);
+
+	/* The batch stops at the first record that does not fit. */
+	REQUIRE(cb_msg_read_batch(buffer, target, 4, lengths, 8) == -1);
+	REQUIRE(errno == EMSGSIZE);
+	REQUIRE(cb_msg_read_batch(buffer, target, 6, lengths, 8) == 1);
+	REQUIRE(lengths[0] == 5);
+	REQUIRE(memcmp(target, "hijkl", 5) == 0);
+	REQUIRE(cb_msg_read(buffer, target, sizeof(target)) == 2);
+	cb_destroy(buffer);
+
+	/* Mirrored storage always hands out records in one piece. */
+	buffer = cb_create_flags(1, CB_MIRRORED);
+	REQUIRE(buffer != 0);
+	/* Each record takes 17 bytes, so some of them straddle the end. */
+	for (i = 0; i < 2 * buffer->length; i += 17) {
+		REQUIRE(cb_msg_write(buffer, target, sizeof(target)) == sizeof(target));
+		REQUIRE(cb_msg_peek(buffer, &seg1, &len1, &seg2, &len2) == sizeof(target));
+		REQUIRE(len1 == sizeof(target));
+		REQUIRE(len2 == 0);
+		REQUIRE(cb_msg_consume(buffer) == sizeof(target));
+	}
+	cb_destroy(buffer);
+}
+
+struct counted {
+	static int live;
+	int value;
+
+	counted(int v) : value(v) { live++; }
+	counted(const counted &other) : value(other.value) { live++; }
+	counted &operator=(const counted &other) { value = other.value; return *this; }
+	~counted() { live--; }
+};
+int counted::live = 0;
+
+/* Move-constructible, but neither copyable nor assignable. */
+struct frozen {
+	const int value;
+	std::unique_ptr<int> data;
+
+	frozen(int v) : value(v), data(new int(v)) {}
+};
+
+TEST_CASE("C++ ring of non-trivial elements", "[cpp]")
+{
+	static_assert(cb::ring<int, 8>::capacity() == 8, "capacity is constexpr");
+
+	SECTION("power of two capacity") {
+		cb::ring<std::string, 4> ring;
+		std::string s;
+		int i;
+
+		REQUIRE(ring.empty());
+		REQUIRE_FALSE(ring.pop(s));
+		/* Run several laps so head and tail wrap. */
+		for (i = 0; i < 10; i++) {
+			REQUIRE(ring.push(std::to_string(i)));
+			REQUIRE(ring.emplace(3, 'x'));
+			REQUIRE(ring.size() == 2);
+			REQUIRE(ring.pop(s));
+			REQUIRE(s == std::to_string(i));
+			REQUIRE(*ring.front() == "xxx");
+			REQUIRE(ring.pop(s));
+		}
+		for (i = 0; i < 4; i++)
+			REQUIRE(ring.push(std::string(100, 'a' + i)));
+		REQUIRE(ring.full());
+		REQUIRE_FALSE(ring.push(std::string("overflow")));
+		REQUIRE(ring.pop(s));
+		REQUIRE(s == std::string(100, 'a'));
+	}
+
+	SECTION("other capacities") {
+		cb::ring<std::unique_ptr<int>, 3> ring;
+		std::unique_ptr<int> p;
+		int i;
+
+		for (i = 0; i < 10; i++) {
+			REQUIRE(ring.push(std::unique_ptr<int>(new int(i))));
+			REQUIRE(ring.push(std::unique_ptr<int>(new int(i + 1))));
+			REQUIRE(ring.push(std::unique_ptr<int>(new int(i + 2))));
+			REQUIRE(ring.full());
+			REQUIRE_FALSE(ring.push(std::unique_ptr<int>(new int(-1))));
+			REQUIRE(ring.pop(p));
+			REQUIRE(*p == i);
+			REQUIRE(ring.size() == 2);
+			ring.clear();
+			REQUIRE(ring.empty());
+		}
+	}
+
+	SECTION("elements are destroyed") {
+		{
+			cb::ring<counted, 5> ring;
+			counted c(0);
+
+			REQUIRE(ring.emplace(1));
+			REQUIRE(ring.emplace(2));
+			REQUIRE(ring.emplace(3));
+			REQUIRE(counted::live == 4);
+			REQUIRE(ring.pop(c));
+			REQUIRE(c.value == 1);
+			REQUIRE(counted::live == 3);
+		}
+		/* The ring destroyed the two elements it still held. */
+		REQUIRE(counted::live == 0);
+	}
+
+	SECTION("elements are move-constructed out") {
+		cb::ring<frozen, 3> ring;
+		std::optional<frozen> f;
+		int i;
+
+		REQUIRE_FALSE(ring.pop());
+		for (i = 0; i < 10; i++) {
+			REQUIRE(ring.emplace(i));
+			REQUIRE(ring.emplace(i + 1));
+			f.emplace(*ring.pop());
+			REQUIRE(f->value == i);
+			REQUIRE(*f->data == i);
+			f.emplace(*ring.pop());
+			REQUIRE(f->value == i + 1);
+			REQUIRE(ring.empty());
+		}
+	}
+}
+
+#define RING_ITEMS 1000000
+
+static cb::ring<long, 64> _ring;
+
+static void* ring_producer(void *arg)
+{
+	long i;
+
+	for (i = 0; i < RING_ITEMS; i++) {
+		while (!_ring.push(i))
+			sched_yield();
+	}
+	return 0;
+}
+
+TEST_CASE("C++ ring multithreading", "[cpp][multithread]")
+{
+	pthread_t thread;
+	long i, value;
+
+	REQUIRE(pthread_create(&thread, NULL, &ring_producer, NULL) == 0);
+	for (i = 0; i < RING_ITEMS; i++) {
+		while (!_ring.pop(value))
+			sched_yield();
+		if (value != i)
+			FAIL("C++ ring elements are out of order.");
+	}
+	pthread_join(thread, NULL);
+	REQUIRE(_ring.empty());
+}
+
+TEST_CASE("Circular buffer vectored descriptor I/O", "[fd]")
+{
+	struct circular_buffer *buffer;
+	char data[] = "0123456789abcdef", target[16];
+	int fds[2], flags[] = { 0, CB_POW2, CB_SPSC };
+	size_t i;
+
+	for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+		buffer = cb_create_flags(8, flags[i]);
+		REQUIRE(buffer != 0);
+		REQUIRE(pipe(fds) == 0);
+
+		/* Move the positions so the transfers cross the wrap point. */
+		REQUIRE(cb_write(buffer, data, 6) == 6);
+		REQUIRE(cb_read(buffer, target, 6) == 6);
+
+		REQUIRE(write(fds[1], data, 10) == 10);
+		REQUIRE(cb_write_from_fd(buffer, fds[0], 5) == 5);
+		REQUIRE(cb_write_from_fd(buffer, fds[0], 16) == 3);
+		REQUIRE(cb_write_from_fd(buffer, fds[0], 16) == -1);
+		REQUIRE(errno == ENOBUFS);
+
+		REQUIRE(cb_read_to_fd(buffer, fds[1], 16) == 8);
+		REQUIRE(cb_empty(buffer));
+		REQUIRE(cb_read_to_fd(buffer, fds[1], 16) == 0);
+		REQUIRE(read(fds[0], target, sizeof(target)) == 10);
+		REQUIRE(memcmp(target, "89", 2) == 0);
+		REQUIRE(memcmp(target + 2, data, 8) == 0);
+
+		/* End of file reads as zero, like read(). */
+		close(fds[1]);
+		REQUIRE(cb_write_from_fd(buffer, fds[0], 16) == 0);
+		close(fds[0]);
+
+		cb_destroy(buffer);
+	}
+}
+
+TEST_CASE("Circular buffer splice to a pipe", "[splice]")
+{
+	struct circular_buffer *buffer;
+	long page = sysconf(_SC_PAGESIZE);
+	char data[3 * 4096], target[3 * 4096];
+	int fds[2];
+	size_t i;
+	ssize_t ret, sent;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+
+	buffer = cb_create_flags(100, CB_PAGE_ALIGNED);
+	REQUIRE(buffer != 0);
+	/* The storage is whole pages, minus the byte telling full from empty. */
+	REQUIRE(((uintptr_t)buffer->buffer % page) == 0);
+	REQUIRE(buffer->length == (size_t)page - 1);
+	cb_destroy(buffer);
+
+	buffer = cb_create_flags(2 * 4096, CB_PAGE_ALIGNED | CB_POW2);
+	REQUIRE(buffer != 0);
+	REQUIRE(pipe(fds) == 0);
+	/* A single page pipe cannot take everything at once. */
+	REQUIRE(fcntl(fds[1], F_SETPIPE_SZ, page) == page);
+
+	REQUIRE(cb_splice_out(buffer, fds[1], 100) == 0);
+	REQUIRE(cb_write64(buffer, data, 4096) == 4096);
+	REQUIRE(cb_read64(buffer, target, 4096) == 4096);
+	/* The data now wraps around the end of the storage. */
+	REQUIRE(cb_write64(buffer, data, 6000) == 6000);
+
+	sent = 0;
+	while (sent < 6000) {
+		ret = cb_splice_out(buffer, fds[1], 6000);
+		REQUIRE(ret > 0);
+		REQUIRE(ret <= page);
+		REQUIRE(read(fds[0], target + sent, ret) == ret);
+		sent += ret;
+		REQUIRE(cb_available_data64(buffer) == (size_t)(6000 - sent));
+	}
+	REQUIRE(memcmp(target, data, 6000) == 0);
+	REQUIRE(cb_splice_out(buffer, fds[1], 6000) == 0);
+
+	close(fds[0]);
+	close(fds[1]);
+	cb_destroy(buffer);
+}
+
+TEST_CASE("Circular buffer splice keeps data in flight intact", "[splice]")
+{
+	struct circular_buffer *buffer;
+	long page = sysconf(_SC_PAGESIZE);
+	std::string a(page, 'A'), b(100, 'B'), x(page, 'x'), z(2 * page, 'Z');
+	std::string target(2 * page, 0);
+	int fds[2];
+
+	/* Two pages, so rewriting the whole ring reuses the spliced one. */
+	buffer = cb_create_flags(2 * page - 1, CB_PAGE_ALIGNED);
+	REQUIRE(buffer != 0);
+	REQUIRE(pipe(fds) == 0);
+	REQUIRE(fcntl(fds[1], F_SETPIPE_SZ, page) == page);
+	REQUIRE(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+
+	/* The pipe keeps referencing the page after splice() returns. */
+	REQUIRE(cb_write64(buffer, &a[0], page) == page);
+	REQUIRE(cb_splice_out(buffer, fds[1], page) == page);
+	REQUIRE(cb_write64(buffer, &z[0], buffer->length) == (ssize_t)buffer->length);
+	REQUIRE(read(fds[0], &target[0], page) == page);
+	REQUIRE(memcmp(&target[0], &a[0], page) == 0);
+	/* cb_clear keeps head where it is; start over on a page boundary. */
+	cb_destroy(buffer);
+	buffer = cb_create_flags(2 * page - 1, CB_PAGE_ALIGNED);
+	REQUIRE(buffer != 0);
+
+	/* A full destination leaves the page in the internal pipe... */
+	REQUIRE(write(fds[1], &x[0], page) == page);
+	REQUIRE(cb_write64(buffer, &a[0], page) == page);
+	REQUIRE(cb_write64(buffer, &b[0], 100) == 100);
+	REQUIRE(cb_splice_out(buffer, fds[1], 2 * page) == -1);
+	REQUIRE(errno == EAGAIN);
+	/* ...which no longer counts as data, so other reads skip it. */
+	REQUIRE(cb_available_data(buffer) == 100);
+	REQUIRE(cb_read(buffer, &target[0], 2 * page) == 100);
+	REQUIRE(memcmp(&target[0], &b[0], 100) == 0);
+	REQUIRE(cb_write64(buffer, &z[0], buffer->length) == (ssize_t)buffer->length);
+
+	REQUIRE(read(fds[0], &target[0], page) == page);
+	REQUIRE(cb_splice_out(buffer, fds[1], page) == page);
+	REQUIRE(read(fds[0], &target[0], page) == page);
+	REQUIRE(memcmp(&target[0], &a[0], page) == 0);
+
+	close(fds[0]);
+	close(fds[1]);
+	cb_destroy(buffer);
+}
+
+TEST_CASE("io_uring engine fills and drains buffers", "[uring]")
+{
+	struct circular_buffer *in, *out;
+	struct cb_uring *ring;
+	char data[1000], target[1000];
+	int source[2], sink[2], fill, drain, rounds, n;
+	size_t i;
+
+	ring = cb_uring_create(8);
+	if (!ring) {
+		WARN("io_uring is not available, skipping");
+		return;
+	}
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+	in = cb_create(64);
+	out = cb_create(64);
+	REQUIRE(in != 0);
+	REQUIRE(out != 0);
+	REQUIRE(pipe(source) == 0);
+	REQUIRE(pipe(sink) == 0);
+	REQUIRE(cb_uring_add(ring, in, -1, 0) == -1);
+
+	fill = cb_uring_add(ring, in, source[0], CB_URING_FILL);
+	drain = cb_uring_add(ring, out, sink[1], CB_URING_DRAIN);
+	REQUIRE(fill >= 0);
+	REQUIRE(drain >= 0);
+	REQUIRE(write(source[1], data, sizeof(data)) == sizeof(data));
+	close(source[1]);
+
+	/* Move everything from the source pipe through both buffers. */
+	for (rounds = 0; cb_uring_status(ring, fill) == 0; rounds++) {
+		REQUIRE(cb_uring_run(ring, 1) >= 0);
+		while ((n = cb_read(in, target, cb_available_space(out))) > 0)
+			REQUIRE(cb_write(out, target, n) == n);
+		REQUIRE(rounds < 10000);
+	}
+	while (!cb_empty(out))
+		REQUIRE(cb_uring_run(ring, 1) >= 0);
+
+	REQUIRE(read(sink[0], target, sizeof(target)) == sizeof(target));
+	REQUIRE(memcmp(target, data, sizeof(data)) == 0);
+	REQUIRE(cb_uring_status(ring, drain) == 0);
+
+	cb_uring_destroy(ring);
+	close(source[0]);
+	close(sink[0]);
+	close(sink[1]);
+	cb_destroy(in);
+	cb_destroy(out);
+}
+
+#define SHM_ITEMS 100000
+
+TEST_CASE("Circular buffer shared between processes", "[shm][multithread]")
+{
+	struct circular_buffer *buffer, *other;
+	char name[64], target[3];
+	int flags[] = { 0, CB_SPSC, CB_MPSC };
+	int i, value, status;
+	size_t f, storage;
+	pid_t pid;
+
+	for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		snprintf(name, sizeof(name), "/cb_test_%d", (int)getpid());
+		cb_unlink_shm(name);
+
+		buffer = cb_create_shm(name, 1000, flags[f]);
+		REQUIRE(buffer != 0);
+		REQUIRE(buffer->buffer == 0);
+		REQUIRE(cb_create_shm(name, 1000, flags[f]) == 0);
+		REQUIRE(errno == EEXIST);
+		/* Descriptors cannot be shared through the buffer. */
+		REQUIRE(cb_get_read_fd(buffer) == -1);
+
+		/* The storage is mapped twice, wherever it ends up. */
+		other = cb_open_shm(name);
+		REQUIRE(other != 0);
+		REQUIRE(other != buffer);
+		REQUIRE(other->length == buffer->length);
+		REQUIRE(cb_write(buffer, (char*) "abc", 3) == 3);
+		REQUIRE(memcmp(cb_starts_at(other), "abc", 3) == 0);
+		storage = other->mask == (size_t)-1 ? other->length + 1 : other->length;
+		REQUIRE(cb_storage(other)[storage] == 'a');
+		REQUIRE(cb_read(other, target, 3) == 3);
+		cb_destroy(other);
+
+		pid = fork();
+		REQUIRE(pid >= 0);
+		if (pid == 0) {
+			/* The child writes through its own mapping. */
+			snprintf(name, sizeof(name), "/cb_test_%d", (int)getppid());
+			other = cb_open_shm(name);
+			if (!other)
+				_exit(1);
+			for (i = 0; i < SHM_ITEMS; i++) {
+				if (cb_write_wait(other, (char*) &i, sizeof(i), -1) < 0)
+					_exit(2);
+			}
+			cb_destroy(other);
+			_exit(0);
+		}
+
+		/* The parent sleeps on the shared futex until data arrives. */
+		for (i = 0; i < SHM_ITEMS; i++) {
+			REQUIRE(cb_read_wait(buffer, (char*) &value, sizeof(value),
+				sizeof(value), -1) == sizeof(value));
+			if (value != i)
+				FAIL("Shared memory records are out of order.");
+		}
+		REQUIRE(waitpid(pid, &status, 0) == pid);
+		REQUIRE(WIFEXITED(status));
+		REQUIRE(WEXITSTATUS(status) == 0);
+
+		REQUIRE(cb_unlink_shm(name) == 0);
+		REQUIRE(cb_open_shm(name) == 0);
+		REQUIRE(errno == ENOENT);
+		cb_destroy(buffer);
+	}
+}
+
+TEST_CASE("Circular buffer statistics", "[stats]")
+{
+	static const int flags[] = { 0, CB_SPSC, CB_MPSC, CB_OVERWRITE };
+	struct circular_buffer *buffer;
+	struct cb_stats stats;
+	char data[64] = { 0 }, target[64];
+	size_t f;
+
+	buffer = cb_create64(64);
+	REQUIRE(cb_get_stats(buffer, &stats) == -1);
+	REQUIRE(errno == EINVAL);
+	cb_destroy(buffer);
+
+	for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		buffer = cb_create_flags(64, flags[f] | CB_STATS);
+		REQUIRE(buffer != 0);
+		REQUIRE(cb_get_stats(buffer, &stats) == 0);
+		REQUIRE(stats.writes == 0);
+		REQUIRE(stats.high_water == 0);
+
+		REQUIRE(cb_write(buffer, data, 40) == 40);
+		REQUIRE(cb_write(buffer, data, 10) == 10);
+		if (flags[f] == CB_OVERWRITE)
+			REQUIRE(cb_write(buffer, data, 40) == 40);
+		else
+			REQUIRE(cb_write(buffer, data, 40) == -1);
+		REQUIRE(cb_read(buffer, target, 30) == 30);
+		REQUIRE(cb_read(buffer, target, 64) < 64);
+		REQUIRE(cb_read(buffer, target, 64) == 0);
+		REQUIRE(cb_read_wait(buffer, target, 1, 1, 1000000) == -1);
+
+		REQUIRE(cb_get_stats(buffer, &stats) == 0);
+		REQUIRE(stats.reads == 2);
+		REQUIRE(stats.reads_short == 3);
+		REQUIRE(stats.read_wait_ns >= 1000000);
+		REQUIRE(stats.lock_contended == 0);
+		if (flags[f] == CB_OVERWRITE) {
+			/* Overwritten bytes are dropped, not read. */
+			REQUIRE(stats.writes == 3);
+			REQUIRE(stats.bytes_written == 90);
+			REQUIRE(stats.writes_rejected == 0);
+			REQUIRE(stats.high_water == buffer->length);
+			REQUIRE(stats.bytes_read == buffer->length);
+		} else {
+			REQUIRE(stats.writes == 2);
+			REQUIRE(stats.bytes_written == 50);
+			REQUIRE(stats.writes_rejected == 1);
+			REQUIRE(stats.high_water == 50);
+			REQUIRE(stats.bytes_read == 50);
+		}
+
+		/* Clearing empties the buffer but keeps the counters. */
+		REQUIRE(cb_write(buffer, data, 5) == 5);
+		cb_clear(buffer);
+		REQUIRE(cb_get_stats(buffer, &stats) == 0);
+		REQUIRE(stats.bytes_read == (flags[f] == CB_OVERWRITE ? buffer->length : 50));
+		cb_destroy(buffer);
+	}
+}
+
+static void *lock_profile_hammer(void *arg)
+{
+	struct circular_buffer *buffer = (struct circular_buffer *) arg;
+	char data[16] = { 0 };
+	int i;
+
+	for (i = 0; i < 100000; i++) {
+		cb_write(buffer, data, sizeof(data));
+		cb_read(buffer, data, sizeof(data));
+	}
+	return NULL;
+}
+
+TEST_CASE("Circular buffer lock profile", "[lockprofile][multithread]")
+{
+	struct circular_buffer *buffer;
+	struct cb_lock_profile profile;
+	pthread_t threads[4];
+	size_t i, total = 0;
+
+	buffer = cb_create64(1024);
+	if (cb_get_lock_profile(buffer, &profile) < 0) {
+		REQUIRE(errno == ENOSYS);
+		WARN("Built without CB_LOCK_PROFILE, skipping");
+		cb_destroy(buffer);
+		return;
+	}
+	REQUIRE(profile.acquisitions == 0);
+
+	for (i = 0; i < 4; i++)
+		REQUIRE(pthread_create(&threads[i], NULL, lock_profile_hammer, buffer) == 0);
+	for (i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+
+	REQUIRE(cb_get_lock_profile(buffer, &profile) == 0);
+	REQUIRE(profile.acquisitions == 800000);
+	for (i = 0; i < CB_LOCK_BUCKETS; i++)
+		total += profile.blocked[i];
+	REQUIRE(total == profile.contended);
+	REQUIRE(profile.contended <= profile.acquisitions);
+	cb_destroy(buffer);
+
+	/* Lock-free buffers have no mutex to profile. */
+	buffer = cb_create_flags(1024, CB_SPSC);
+	REQUIRE(cb_get_lock_profile(buffer, &profile) == -1);
+	REQUIRE(errno == EINVAL);
+	cb_destroy(buffer);
+}
+
+TEST_CASE("Circular buffer residence time histogram", "[latency]")
+{
+	static const int flags[] = { 0, CB_SPSC, CB_MPSC };
+	struct circular_buffer *buffer;
+	struct cb_latency latency;
+	char data[64] = { 0 }, target[64];
+	size_t f, i, total;
+
+	buffer = cb_create64(64);
+	REQUIRE(cb_get_latency(buffer, &latency) == -1);
+	REQUIRE(errno == EINVAL);
+	cb_destroy(buffer);
+	REQUIRE(cb_create_shm("/cb_test_latency", 64, CB_LATENCY) == 0);
+	REQUIRE(errno == EINVAL);
+
+	for (f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+		buffer = cb_create_flags(64, flags[f] | CB_LATENCY);
+		REQUIRE(buffer != 0);
+
+		REQUIRE(cb_write(buffer, data, 10) == 10);
+		REQUIRE(cb_write(buffer, data, 10) == 10);
+		usleep(2000);
+		/* A write only counts once its last byte is read. */
+		REQUIRE(cb_read(buffer, target, 15) == 15);
+		REQUIRE(cb_get_latency(buffer, &latency) == 0);
+		REQUIRE(latency.count == 1);
+		REQUIRE(latency.max_ns >= 2000000);
+		REQUIRE(cb_read(buffer, target, 5) == 5);
+
+		REQUIRE(cb_get_latency(buffer, &latency) == 0);
+		REQUIRE(latency.count == 2);
+		for (i = 0, total = 0; i < CB_LATENCY_BUCKETS; i++)
+			total += latency.buckets[i];
+		REQUIRE(total == 2);
+		REQUIRE(latency.total_ns >= 4000000);
+		REQUIRE(cb_latency_percentile(&latency, 50) >= 1900000);
+		REQUIRE(cb_latency_percentile(&latency, 100) == latency.max_ns);
+
+		/* Cleared data is never read. */
+		REQUIRE(cb_write(buffer, data, 10) == 10);
+		cb_clear(buffer);
+		REQUIRE(cb_reset_latency(buffer) == 0);
+		REQUIRE(cb_get_latency(buffer, &latency) == 0);
+		REQUIRE(latency.count == 0);
+		REQUIRE(latency.max_ns == 0);
+		REQUIRE(cb_latency_percentile(&latency, 99) == 0);
+
+		/* Records are timed one by one. */
+		REQUIRE(cb_msg_write(buffer, data, 3) == 3);
+		REQUIRE(cb_msg_write(buffer, data, 4) == 4);
+		REQUIRE(cb_msg_read(buffer, target, sizeof(target)) == 3);
+		REQUIRE(cb_msg_read(buffer, target, sizeof(target)) == 4);
+		REQUIRE(cb_get_latency(buffer, &latency) == 0);
+		REQUIRE(latency.count == 2);
+		cb_destroy(buffer);
+	}
+
+	/* Overwritten writes are dropped, not timed. */
+	buffer = cb_create_flags(64, CB_OVERWRITE | CB_LATENCY);
+	REQUIRE(cb_write(buffer, data, 40) == 40);
+	REQUIRE(cb_write(buffer, data, 40) == 40);
+	REQUIRE(cb_write(buffer, data, 40) == 40);
+	REQUIRE(cb_read(buffer, target, 64) == 64);
+	REQUIRE(cb_get_latency(buffer, &latency) == 0);
+	REQUIRE(latency.count == 2);
+	cb_destroy(buffer);
+}